@@ -0,0 +1,486 @@
+// Runs the benchmark firmware image (env:benchmark) under simavr and reports, as JSON on stdout,
+// how many cycles each instrumented region took. Usage:
+//
+//   mmu_bench firmware.elf benchmark.txt > report.json
+//
+// The firmware marks regions by writing their ID to GPIOR1 on entry and GPIOR2 on exit, see
+// BENCH_BEGIN in src/main.cpp. The step interrupt is also timed as a whole vector, from the jump to
+// TIMER1_COMPB until its reti, so the register saves the markers miss count too. Around it this emulates what the board sees: serial commands from
+// the script, an MCP23017 on I2C with the loaded slots, and a filament that reaches the hub sensor
+// after a number of steps forward.
+//
+// Script lines:
+//   send <command>     send a command and run until it answers OK or ERROR, or for a motion
+//                      command answered OK OP=<id>, until its DONE event
+//   wait <ms>          run for a while
+//   filaments <mask>   slots with filament loaded, one bit per slot
+//   hub_steps <n>      steps from the parked filament tip to the hub sensor
+
+#include <simavr/avr_ioport.h>
+#include <simavr/avr_twi.h>
+#include <simavr/avr_uart.h>
+#include <simavr/sim_avr.h>
+#include <simavr/sim_elf.h>
+#include <simavr/sim_io.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CPU_FREQUENCY 16000000UL
+#define STEPPER_CPU_SHARE 2  // max_step_rate leaves the step interrupt 1/2 of the CPU, the rest to loop() and serial
+#define CYCLES_PER_MS (CPU_FREQUENCY / 1000)
+#define COMMAND_TIMEOUT_MS 60000
+
+#define GPIOR1_ADDRESS 0x4A
+#define GPIOR2_ADDRESS 0x4B
+
+#define MCP_ADDRESS (0x20 << 1)  // simavr passes the address byte, R/W bit included
+#define MCP_REGISTERS 0x16
+#define MCP_GPIOA 0x12
+#define MCP_GPIOB 0x13
+
+#define REGION_COUNT 256
+#define BENCH_STEPPER_ISR 1
+#define BENCH_INPUT_SCAN 2
+#define BENCH_PIXELS_SHOW 3
+#define BENCH_STEPPER_VECTOR 0x3F  // not a firmware marker, timed from the vector address
+#define BENCH_COMMAND 0x40
+
+#define TIMER1_COMPB_VECTOR 12
+#define INTERRUPT_RESPONSE_CYCLES 4  // push and jump to the vector, simavr doesn't charge them
+
+#define LINE_SIZE 256
+#define INPUT_QUEUE_SIZE 1024
+
+// Same order as CommandId in src/main.cpp
+static const char* COMMAND_NAMES[] = {"START", "SYNC", "FILAMENT_RELEASE", "FILAMENT", "EXTRUDE", "RETRACT",
+                                      "SWAP_FINISH", "CUTTER_POSITION", "MMU_POSITION", "MMU_ROTATE", "MIDI",
+                                      "TEST_LEDS", "TEST_LED", "BINARY", "LOG_DUMP", "LOG_LEVEL", "STATS",
+                                      "STATS_RESET", "CALIBRATE", "SWAP", "FEED"};
+#define COMMAND_NAME_COUNT (sizeof(COMMAND_NAMES) / sizeof(COMMAND_NAMES[0]))
+
+typedef struct {
+    uint64_t start;
+    uint64_t count;
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    int open;
+} Region;
+
+static Region regions[REGION_COUNT];
+
+static uint8_t inputQueue[INPUT_QUEUE_SIZE];
+static size_t inputHead = 0;
+static size_t inputTail = 0;
+static int uartReady = 1;
+static avr_irq_t* uartInput;
+
+static char line[LINE_SIZE];
+static size_t lineLength = 0;
+static int responseReceived = 0;
+static long sramFreeMin = -1;
+
+static uint8_t mcpRegisters[MCP_REGISTERS];
+static uint16_t mcpInputs = 0xFFFF;
+static uint8_t mcpSelected = 0;
+static uint8_t mcpPointer = 0;
+static int mcpPointerSet = 0;
+static avr_irq_t* mcpIrq;
+static avr_irq_t* mcpInterruptIrq;
+static uint16_t mcpReadInputs = 0xFFFF;  // as of the last GPIO read, INTA is low while they differ
+
+static int stepperVectorOpen = 0;
+static uint16_t stepperVectorReturnSp = 0;  // stack pointer once its reti popped the return address
+
+static avr_irq_t* hubIrq;
+static long filamentPosition = 0;
+static long hubSteps = 20000;
+static int hubLoaded = 0;
+static int stepperForward = 0;
+
+static void beginRegion(struct avr_t* avr, avr_io_addr_t address, uint8_t value, void* param) {
+    regions[value].start = avr->cycle;
+    regions[value].open = 1;
+}
+
+static void endRegion(struct avr_t* avr, avr_io_addr_t address, uint8_t value, void* param) {
+    Region* region = &regions[value];
+
+    if (!region->open) {
+        return;
+    }
+
+    uint64_t cycles = avr->cycle - region->start;
+
+    if (region->count == 0 || cycles < region->min) {
+        region->min = cycles;
+    }
+
+    if (cycles > region->max) {
+        region->max = cycles;
+    }
+
+    region->count++;
+    region->total += cycles;
+    region->open = 0;
+}
+
+static uint16_t getStackPointer(avr_t* avr) {
+    return avr->data[R_SPL] | (avr->data[R_SPH] << 8);
+}
+
+// Called after every instruction: the vector opens when the core has just jumped to it and closes
+// when the stack is back where it was before the return address got pushed
+static void trackStepperVector(avr_t* avr) {
+    if (stepperVectorOpen) {
+        if (getStackPointer(avr) == stepperVectorReturnSp) {
+            endRegion(avr, 0, BENCH_STEPPER_VECTOR, NULL);
+            stepperVectorOpen = 0;
+        }
+        return;
+    }
+
+    if (avr->pc == (avr_flashaddr_t)TIMER1_COMPB_VECTOR * avr->vector_size) {
+        beginRegion(avr, 0, BENCH_STEPPER_VECTOR, NULL);
+        regions[BENCH_STEPPER_VECTOR].start -= INTERRUPT_RESPONSE_CYCLES;
+        stepperVectorReturnSp = getStackPointer(avr) + avr->address_size;
+        stepperVectorOpen = 1;
+    }
+}
+
+static void processLine(void) {
+    line[lineLength] = '\0';
+    fprintf(stderr, "<-- %s\n", line);
+
+    if (strcmp(line, "OK") == 0 || strcmp(line, "ERROR") == 0 || strncmp(line, "DONE ", 5) == 0) {
+        responseReceived = 1;
+    }
+
+    const char* sram = strstr(line, "STATS SRAM free_min=");
+
+    if (sram != NULL) {
+        sramFreeMin = strtol(sram + strlen("STATS SRAM free_min="), NULL, 10);
+    }
+}
+
+static void uartOutputHook(struct avr_irq_t* irq, uint32_t value, void* param) {
+    char c = (char)value;
+
+    if (c == '\r') {
+        return;
+    }
+
+    if (c == '\n') {
+        processLine();
+        lineLength = 0;
+    } else if (lineLength < LINE_SIZE - 1) {
+        line[lineLength++] = c;
+    }
+}
+
+static void uartXonHook(struct avr_irq_t* irq, uint32_t value, void* param) {
+    uartReady = 1;
+}
+
+static void uartXoffHook(struct avr_irq_t* irq, uint32_t value, void* param) {
+    uartReady = 0;
+}
+
+static void feedUart(void) {
+    while (uartReady && inputTail != inputHead) {
+        avr_raise_irq(uartInput, inputQueue[inputTail]);
+        inputTail = (inputTail + 1) % INPUT_QUEUE_SIZE;
+    }
+}
+
+static void queueInput(const char* text) {
+    for (; *text != '\0'; text++) {
+        inputQueue[inputHead] = *text;
+        inputHead = (inputHead + 1) % INPUT_QUEUE_SIZE;
+    }
+}
+
+static void updateMcpInterrupt(void) {
+    if (mcpInterruptIrq != NULL) {
+        avr_raise_irq(mcpInterruptIrq, mcpInputs != mcpReadInputs ? 0 : 1);
+    }
+}
+
+// Register pointer then data on writes, sequential reads from the pointer, like IOCON.BANK = 0
+static void mcpHook(struct avr_irq_t* irq, uint32_t value, void* param) {
+    avr_twi_msg_irq_t message;
+    message.u.v = value;
+
+    if (message.u.twi.msg & TWI_COND_STOP) {
+        mcpSelected = 0;
+    }
+
+    if (message.u.twi.msg & TWI_COND_START) {
+        mcpSelected = 0;
+        mcpPointerSet = 0;
+
+        if ((message.u.twi.addr & ~1) == MCP_ADDRESS) {
+            mcpSelected = message.u.twi.addr;
+            avr_raise_irq(mcpIrq + TWI_IRQ_INPUT, avr_twi_irq_msg(TWI_COND_ACK, mcpSelected, 1));
+        }
+    }
+
+    if (!mcpSelected) {
+        return;
+    }
+
+    if (message.u.twi.msg & TWI_COND_WRITE) {
+        avr_raise_irq(mcpIrq + TWI_IRQ_INPUT, avr_twi_irq_msg(TWI_COND_ACK, mcpSelected, 1));
+
+        if (!mcpPointerSet) {
+            mcpPointer = message.u.twi.data % MCP_REGISTERS;
+            mcpPointerSet = 1;
+        } else {
+            mcpRegisters[mcpPointer] = message.u.twi.data;
+            mcpPointer = (mcpPointer + 1) % MCP_REGISTERS;
+        }
+    }
+
+    if (message.u.twi.msg & TWI_COND_READ) {
+        uint8_t data = mcpRegisters[mcpPointer];
+
+        if (mcpPointer == MCP_GPIOA) {
+            data = mcpInputs & 0xFF;
+        } else if (mcpPointer == MCP_GPIOB) {
+            data = mcpInputs >> 8;
+            mcpReadInputs = mcpInputs;
+            updateMcpInterrupt();
+        }
+
+        avr_raise_irq(mcpIrq + TWI_IRQ_INPUT, avr_twi_irq_msg(TWI_COND_READ, mcpSelected, data));
+        mcpPointer = (mcpPointer + 1) % MCP_REGISTERS;
+    }
+}
+
+static void attachMcp(avr_t* avr) {
+    static const char* names[2] = {"8>mcp.out", "32<mcp.in"};
+
+    mcpIrq = avr_alloc_irq(&avr->irq_pool, 0, 2, names);
+    avr_irq_register_notify(mcpIrq + TWI_IRQ_OUTPUT, mcpHook, NULL);
+
+    avr_connect_irq(mcpIrq + TWI_IRQ_INPUT, avr_io_getirq(avr, AVR_IOCTL_TWI_GETIRQ(0), TWI_IRQ_INPUT));
+    avr_connect_irq(avr_io_getirq(avr, AVR_IOCTL_TWI_GETIRQ(0), TWI_IRQ_OUTPUT), mcpIrq + TWI_IRQ_OUTPUT);
+}
+
+// Slot 1 is MCP pin 15 (GPIOB7), slot 8 is pin 8, low with filament
+static void setLoadedFilaments(unsigned long mask) {
+    for (int slot = 0; slot < 8; slot++) {
+        uint16_t bit = 1U << (15 - slot);
+
+        if (mask & (1UL << slot)) {
+            mcpInputs &= ~bit;
+        } else {
+            mcpInputs |= bit;
+        }
+    }
+
+    updateMcpInterrupt();
+}
+
+// STEP is D8 (PB0), DIR is D7 (PD7) high towards the hub, the hub sensor on D2 (PD2) pulls low
+static void directionHook(struct avr_irq_t* irq, uint32_t value, void* param) {
+    stepperForward = value != 0;
+}
+
+static void stepHook(struct avr_irq_t* irq, uint32_t value, void* param) {
+    if (!value) {
+        return;
+    }
+
+    filamentPosition += stepperForward ? 1 : -1;
+
+    int loaded = filamentPosition >= hubSteps;
+
+    if (loaded != hubLoaded) {
+        hubLoaded = loaded;
+        avr_raise_irq(hubIrq, loaded ? 0 : 1);
+    }
+}
+
+static void attachPins(avr_t* avr) {
+    avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 0), stepHook, NULL);
+    avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('D'), 7), directionHook, NULL);
+
+    hubIrq = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('D'), 2);
+    avr_raise_irq(hubIrq, 1);
+
+    // MCP23017 INTA on D4, low from an input change until GPIOB is read
+    mcpInterruptIrq = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('D'), 4);
+    updateMcpInterrupt();
+}
+
+static void attachUart(avr_t* avr) {
+    uint32_t flags = 0;
+    avr_ioctl(avr, AVR_IOCTL_UART_GET_FLAGS('0'), &flags);
+    flags &= ~AVR_UART_FLAG_STDIO;
+    avr_ioctl(avr, AVR_IOCTL_UART_SET_FLAGS('0'), &flags);
+
+    avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_OUTPUT), uartOutputHook, NULL);
+    avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_OUT_XON), uartXonHook, NULL);
+    avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_OUT_XOFF), uartXoffHook, NULL);
+
+    uartInput = avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_INPUT);
+}
+
+// Returns 0 once waitForResponse is satisfied or the time is up, -1 if the core stopped
+static int runFor(avr_t* avr, unsigned long milliseconds, int waitForResponse) {
+    uint64_t end = avr->cycle + (uint64_t)milliseconds * CYCLES_PER_MS;
+
+    while (avr->cycle < end) {
+        feedUart();
+
+        int state = avr_run(avr);
+
+        if (state == cpu_Done || state == cpu_Crashed) {
+            return -1;
+        }
+
+        trackStepperVector(avr);
+
+        if (waitForResponse && responseReceived) {
+            return 0;
+        }
+    }
+
+    return waitForResponse ? 1 : 0;
+}
+
+static int runScript(avr_t* avr, const char* path) {
+    FILE* script = fopen(path, "r");
+
+    if (script == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    char text[LINE_SIZE];
+    int result = 0;
+
+    while (result == 0 && fgets(text, sizeof(text), script) != NULL) {
+        text[strcspn(text, "\r\n")] = '\0';
+
+        if (text[0] == '\0' || text[0] == '#') {
+            continue;
+        }
+
+        if (strncmp(text, "send ", 5) == 0) {
+            fprintf(stderr, "--> %s\n", text + 5);
+            responseReceived = 0;
+            queueInput(text + 5);
+            queueInput("\n");
+            result = runFor(avr, COMMAND_TIMEOUT_MS, 1);
+
+            if (result > 0) {
+                fprintf(stderr, "No response to %s\n", text + 5);
+            }
+        } else if (strncmp(text, "wait ", 5) == 0) {
+            result = runFor(avr, strtoul(text + 5, NULL, 0), 0);
+        } else if (strncmp(text, "filaments ", 10) == 0) {
+            setLoadedFilaments(strtoul(text + 10, NULL, 0));
+        } else if (strncmp(text, "hub_steps ", 10) == 0) {
+            hubSteps = strtol(text + 10, NULL, 0);
+        } else {
+            fprintf(stderr, "Unknown script line: %s\n", text);
+            result = -1;
+        }
+    }
+
+    fclose(script);
+    return result;
+}
+
+static void getRegionName(int id, char* name, size_t size) {
+    if (id == BENCH_STEPPER_ISR) {
+        snprintf(name, size, "stepper_isr");
+    } else if (id == BENCH_STEPPER_VECTOR) {
+        snprintf(name, size, "stepper_vector");
+    } else if (id == BENCH_INPUT_SCAN) {
+        snprintf(name, size, "input_scan");
+    } else if (id == BENCH_PIXELS_SHOW) {
+        snprintf(name, size, "pixels_show");
+    } else if (id >= BENCH_COMMAND && id - BENCH_COMMAND < (int)COMMAND_NAME_COUNT) {
+        snprintf(name, size, "command_%s", COMMAND_NAMES[id - BENCH_COMMAND]);
+    } else {
+        snprintf(name, size, "region_%d", id);
+    }
+}
+
+static void printReport(avr_t* avr, int result) {
+    printf("{\n  \"frequency\": %lu,\n  \"cycles\": %llu,\n", CPU_FREQUENCY, (unsigned long long)avr->cycle);
+    printf("  \"completed\": %s,\n", result == 0 ? "true" : "false");
+    printf("  \"sram_free_min\": %ld,\n", sramFreeMin);
+
+    // from the whole vector, within the share of the CPU the step interrupt may take
+    Region* vector = &regions[BENCH_STEPPER_VECTOR];
+    printf("  \"max_step_rate\": %llu,\n",
+           vector->max > 0 ? (unsigned long long)(CPU_FREQUENCY / (STEPPER_CPU_SHARE * vector->max)) : 0ULL);
+
+    printf("  \"regions\": {");
+    const char* separator = "\n";
+
+    for (int id = 0; id < REGION_COUNT; id++) {
+        Region* region = &regions[id];
+
+        if (region->count == 0) {
+            continue;
+        }
+
+        char name[48];
+        getRegionName(id, name, sizeof(name));
+
+        printf("%s    \"%s\": {\"count\": %llu, \"min_cycles\": %llu, \"avg_cycles\": %llu, \"max_cycles\": %llu, "
+               "\"max_us\": %.1f}",
+               separator, name, (unsigned long long)region->count, (unsigned long long)region->min,
+               (unsigned long long)(region->total / region->count), (unsigned long long)region->max,
+               region->max * 1000000.0 / CPU_FREQUENCY);
+        separator = ",\n";
+    }
+
+    printf("\n  }\n}\n");
+}
+
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s firmware.elf script.txt\n", argv[0]);
+        return 2;
+    }
+
+    elf_firmware_t firmware;
+    memset(&firmware, 0, sizeof(firmware));
+
+    if (elf_read_firmware(argv[1], &firmware) != 0) {
+        fprintf(stderr, "Failed to read %s\n", argv[1]);
+        return 2;
+    }
+
+    avr_t* avr = avr_make_mcu_by_name("atmega328p");
+
+    if (avr == NULL) {
+        fprintf(stderr, "simavr has no atmega328p core\n");
+        return 2;
+    }
+
+    avr_init(avr);
+    avr_load_firmware(avr, &firmware);
+    avr->frequency = CPU_FREQUENCY;
+
+    avr_register_io_write(avr, GPIOR1_ADDRESS, beginRegion, NULL);
+    avr_register_io_write(avr, GPIOR2_ADDRESS, endRegion, NULL);
+
+    attachUart(avr);
+    attachMcp(avr);
+    attachPins(avr);
+    setLoadedFilaments(0xFF);
+
+    int result = runScript(avr, argv[2]);
+
+    printReport(avr, result);
+    return result == 0 ? 0 : 1;
+}
@@ -0,0 +1,67 @@
+# Builds bench/mmu_bench.c against simavr, runs the benchmark firmware image through
+# bench/benchmark.txt and prints the report. There are no cycle budgets to check against until a
+# bench run on the real toolchain has produced numbers to set them from.
+#   pio run -e benchmark -t bench
+#   python3 bench/run_benchmark.py .pio/build/benchmark/firmware.elf
+import json
+import os
+import shlex
+import subprocess
+import sys
+
+
+def build_harness(bench_dir, output_path):
+    try:
+        flags = subprocess.check_output(["pkg-config", "--cflags", "--libs", "simavr"], text=True).split()
+    except (OSError, subprocess.CalledProcessError):
+        flags = ["-I/usr/local/include", "-L/usr/local/lib", "-lsimavr", "-lelf"]
+
+    command = ["cc", "-O2", "-o", output_path, os.path.join(bench_dir, "mmu_bench.c")] + flags
+    print(" ".join(shlex.quote(part) for part in command))
+    subprocess.check_call(command)
+
+
+def run_benchmark(firmware_path, build_dir, bench_dir):
+    harness_path = os.path.join(build_dir, "mmu_bench")
+    report_path = os.path.join(build_dir, "benchmark.json")
+
+    build_harness(bench_dir, harness_path)
+
+    with open(report_path, "w") as report_file:
+        subprocess.call([harness_path, firmware_path, os.path.join(bench_dir, "benchmark.txt")], stdout=report_file)
+
+    with open(report_path) as report_file:
+        report = json.load(report_file)
+
+    for name, region in sorted(report["regions"].items()):
+        print(f"{name:28} n={region['count']:<8} avg={region['avg_cycles']:<9} max={region['max_cycles']:<9} "
+              f"({region['max_us']} us)")
+    print(f"max_step_rate={report['max_step_rate']} sram_free_min={report['sram_free_min']}")
+    print(f"Report written to {report_path}")
+
+    if not report.get("completed"):
+        print("FAILED: script did not complete")
+        return 1
+
+    return 0
+
+
+try:
+    Import("env")  # noqa: F821
+
+    def bench_action(target, source, env):
+        bench_dir = os.path.join(env.subst("$PROJECT_DIR"), "bench")
+        return run_benchmark(str(source[0]), env.subst("$BUILD_DIR"), bench_dir)
+
+    env.AddCustomTarget(  # noqa: F821
+        name="bench",
+        dependencies="$BUILD_DIR/${PROGNAME}.elf",
+        actions=bench_action,
+        title="Benchmark",
+        description="Run the firmware under simavr and report cycle counts",
+    )
+except NameError:
+    if __name__ == "__main__":
+        elf_path = sys.argv[1] if len(sys.argv) > 1 else ".pio/build/benchmark/firmware.elf"
+        build_dir = os.path.dirname(os.path.abspath(elf_path))
+        sys.exit(run_benchmark(elf_path, build_dir, os.path.dirname(os.path.abspath(__file__))))
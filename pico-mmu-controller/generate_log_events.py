@@ -0,0 +1,29 @@
+# Pre-build script: exports the LOG_EVENTS list from include/log_events.h to script/log_events.json,
+# which the daemon uses to decode binary LOG_DUMP records. Also runs standalone.
+import json
+import os
+import re
+
+try:
+    Import("env")  # noqa: F821
+    project_dir = env.subst("$PROJECT_DIR")  # noqa: F821
+except NameError:
+    project_dir = os.path.dirname(os.path.abspath(__file__))
+
+header_path = os.path.join(project_dir, "include", "log_events.h")
+output_path = os.path.join(project_dir, "..", "script", "log_events.json")
+
+with open(header_path) as header:
+    events = re.findall(r'EVENT\((\w+),\s*"((?:[^"\\]|\\.)*)"\)', header.read())
+
+content = json.dumps({"events": [{"name": name, "message": message} for name, message in events]}, indent=2) + "\n"
+
+previous = None
+if os.path.exists(output_path):
+    with open(output_path) as output:
+        previous = output.read()
+
+if content != previous:
+    with open(output_path, "w") as output:
+        output.write(content)
+    print(f"Generated {os.path.normpath(output_path)} with {len(events)} log events")
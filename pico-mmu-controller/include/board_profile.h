@@ -0,0 +1,87 @@
+#ifndef BOARD_PROFILE_H
+#define BOARD_PROFILE_H
+
+#include <Arduino.h>
+
+#define FORCE_INLINE inline __attribute__((always_inline))
+
+// ATmega328 pin resolved at compile time: every access is a constant port address and bit mask,
+// so single bit writes compile to sbi/cbi instead of going through digitalWrite's lookup tables.
+template <uint8_t PIN>
+struct FastPin {
+    static_assert(PIN < 20, "ATmega328 has digital pins 0 to 19 only");
+
+    static const uint8_t NUMBER = PIN;
+    static const uint8_t MASK = _BV(PIN < 8 ? PIN : (PIN < 14 ? PIN - 8 : PIN - 14));
+
+    static FORCE_INLINE volatile uint8_t& port() {
+        return PIN < 8 ? PORTD : (PIN < 14 ? PORTB : PORTC);
+    }
+
+    static FORCE_INLINE volatile uint8_t& pins() {
+        return PIN < 8 ? PIND : (PIN < 14 ? PINB : PINC);
+    }
+
+    static FORCE_INLINE volatile uint8_t& ddr() {
+        return PIN < 8 ? DDRD : (PIN < 14 ? DDRB : DDRC);
+    }
+
+    static FORCE_INLINE void high() {
+        port() |= MASK;
+    }
+
+    static FORCE_INLINE void low() {
+        port() &= ~MASK;
+    }
+
+    static FORCE_INLINE void write(bool value) {
+        if (value) {
+            high();
+        } else {
+            low();
+        }
+    }
+
+    static FORCE_INLINE bool read() {
+        return pins() & MASK;
+    }
+
+    static FORCE_INLINE void output() {
+        ddr() |= MASK;
+    }
+
+    static FORCE_INLINE void inputPullup() {
+        ddr() &= ~MASK;
+        port() |= MASK;
+    }
+};
+
+template <uint8_t STEP, uint8_t DIR, uint8_t ENABLE, uint8_t HUB_SENSOR, uint8_t MMU_SERVO, uint8_t CUTTER_SERVO,
+          uint8_t MCP_INTERRUPT, bool INTA_WIRED>
+struct BoardProfile {
+    typedef FastPin<STEP> StepPin;
+    typedef FastPin<DIR> DirPin;
+    typedef FastPin<ENABLE> EnablePin;
+    typedef FastPin<HUB_SENSOR> HubSensorPin;  // must be an external interrupt pin (2 or 3)
+    typedef FastPin<MMU_SERVO> MmuServoPin;
+    typedef FastPin<CUTTER_SERVO> CutterServoPin;
+    typedef FastPin<MCP_INTERRUPT> McpInterruptPin;  // MCP23017 INTA, gates the input scan when wired
+
+    // Without INTA the inputs are polled. Only set it on a board that has the INTA to pin wire,
+    // an unconnected pin sits on its pull-up and would never let a change through.
+    static const bool MCP_INTERRUPT_WIRED = INTA_WIRED;
+};
+
+// Both boards sit on the same protoboard, see pcb/protoboard-diagram.jpg. INTA isn't wired on it yet.
+typedef BoardProfile<8, 7, 9, 2, 10, 3, 4, false> ProMiniBoard;
+typedef BoardProfile<8, 7, 9, 2, 10, 3, 4, false> NanoBoard;
+
+#if defined(MMU_BOARD_NANO)
+typedef NanoBoard Board;
+#elif defined(MMU_BOARD_PRO_MINI)
+typedef ProMiniBoard Board;
+#else
+#error "Select a board profile with -D MMU_BOARD_PRO_MINI or -D MMU_BOARD_NANO"
+#endif
+
+#endif
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <stdint.h>
+
+// Every firmware log line is one of these events. The firmware only records the event ID and up to
+// two integer arguments, which are appended to the message when printed. generate_log_events.py
+// turns this list into script/log_events.json at build time so the daemon can decode binary dumps.
+// Only append new events, the daemon relies on the IDs. An event whose arguments change meaning gets
+// a new ID, the old one stays in place as retired so older dumps still decode.
+#define LOG_EVENTS(EVENT) \
+    EVENT(LOG_STARTING, "Starting...") \
+    EVENT(LOG_MCP23017_INIT_FAILED, "Failed to initialize MCP23017") \
+    EVENT(LOG_RECORDS_OVERWRITTEN, "Log records overwritten: ") \
+    EVENT(LOG_LEVEL_CHANGED, "Log level changed to ") \
+    EVENT(LOG_UNKNOWN_COMMAND, "Unknown command") \
+    EVENT(LOG_COMMAND_TOO_LONG, "Command too long") \
+    EVENT(LOG_UNSUPPORTED_BAUD_RATE, "Unsupported baud rate ") \
+    EVENT(LOG_SWITCHING_TO_BINARY, "Switching to binary frames at ") \
+    EVENT(LOG_BINARY_TIMEOUT, "No binary frame received, back to text mode") \
+    EVENT(LOG_STARTING_UP, "Starting up...") \
+    EVENT(LOG_STARTED, "Started") \
+    EVENT(LOG_SYNCING_CONFIG, "Syncing config...") \
+    EVENT(LOG_INCOMPLETE_FILAMENT_POSITIONS, "Ignoring incomplete filament positions, got ") \
+    EVENT(LOG_SYNC_FILAMENT_POSITION, "New position T") \
+    EVENT(LOG_SYNC_EXTRUDE_MM, "New extrude mm: ") \
+    EVENT(LOG_SYNC_RETRACT_MM, "New retract mm: ") \
+    EVENT(LOG_SYNC_UM_PER_ROTATION, "New um per rotation: ") \
+    EVENT(LOG_SYNC_MM_TO_STUCK, "New mm to stuck: ") \
+    EVENT(LOG_SYNC_MM_ACCEL, "New mm acceleration: ") \
+    EVENT(LOG_SYNC_SERVO_SPEED, "New servo speed: ") \
+    EVENT(LOG_SYNC_SERVO_SLEW, "New servo slew: ") \
+    EVENT(LOG_CONFIG_SYNCED, "Config synced") \
+    EVENT(LOG_RELEASING_FILAMENT, "Releasing filament") \
+    EVENT(LOG_FILAMENT_RELEASED, "Filament released") \
+    EVENT(LOG_SETTING_FILAMENT, "Setting filament T") \
+    EVENT(LOG_FILAMENT_SET, "Filament set") \
+    EVENT(LOG_SET_FILAMENT_FAILED, "Failed to set filament T") \
+    EVENT(LOG_MISSING_FILAMENT, "Setting missing filament, pausing print") \
+    EVENT(LOG_FILAMENT_INSERTED, "Filament inserted T") \
+    EVENT(LOG_FILAMENT_REMOVED, "Filament removed T") \
+    EVENT(LOG_RESETTING_ON_FILAMENT_SENSOR, "Resetting on filament sensor") \
+    EVENT(LOG_HUB_STATE_CHANGED, "Hub state changed to level/step ") \
+    EVENT(LOG_HUB_SENSOR_STUCK, "Hub sensor stucked or missing") \
+    EVENT(LOG_HUB_SENSOR_STUCK_ON_RETRACT, "Hub sensor stucked or missing on retract") \
+    EVENT(LOG_HUB_SENSOR_STUCK_ON_EXTRUDE, "Hub sensor stucked or missing on extrude") \
+    EVENT(LOG_EXTRUDING, "Extruding...") \
+    EVENT(LOG_EXTRUDED, "Extruded") \
+    EVENT(LOG_EXTRUDED_MILIMETERS, "Extruded milimeters: ") /* retired, see LOG_EXTRUDED_MICROMETERS */ \
+    EVENT(LOG_RETRACTING, "Retracting...") \
+    EVENT(LOG_RETRACTED, "Retracted") \
+    EVENT(LOG_RETRACTED_MILIMETERS, "Retracted milimeters: ") /* retired, see LOG_RETRACTED_MICROMETERS */ \
+    EVENT(LOG_SWAP_FINISHING, "Swap finishing...") \
+    EVENT(LOG_SWAP_FINISHED, "Swap finished") \
+    EVENT(LOG_SWAP_NOT_FINISHED, "Swap not finished") \
+    EVENT(LOG_SETTING_CUTTER_POSITION, "Setting cutter position to ") \
+    EVENT(LOG_CUTTER_POSITION_SET, "Cutter position set to ") \
+    EVENT(LOG_SETTING_MMU_POSITION, "Setting MMU position to ") \
+    EVENT(LOG_MMU_POSITION_SET, "MMU position set to ") \
+    EVENT(LOG_ROTATING_MMU, "Rotating MMU degrees/RPM ") \
+    EVENT(LOG_MMU_ROTATED, "MMU rotated ") \
+    EVENT(LOG_ACTION_BUTTON_LONG, "Action button pressed long") \
+    EVENT(LOG_ACTION_BUTTON_SHORT, "Action button pressed short") \
+    EVENT(LOG_PLAYING_MIDI, "Playing MIDI ") \
+    EVENT(LOG_MIDI_QUEUED, "MIDI queued") \
+    EVENT(LOG_PLAY_MIDI_FAILED, "Failed to play MIDI ") \
+    EVENT(LOG_UNKNOWN_MIDI, "Unknown MIDI ") \
+    EVENT(LOG_TESTING_LEDS, "Testing LEDs...") \
+    EVENT(LOG_LEDS_TESTED, "LEDs tested") \
+    EVENT(LOG_TESTING_LED, "Testing LED ") \
+    EVENT(LOG_LED_TESTED, "LED tested") \
+    EVENT(LOG_HUB_CROSSING, "Hub crossed after um/steps ") \
+    EVENT(LOG_HUB_EVENTS_DROPPED, "Hub events dropped: ") \
+    EVENT(LOG_CALIBRATING, "Calibrating T") \
+    EVENT(LOG_CALIBRATED, "Calibrated") \
+    EVENT(LOG_CALIBRATION_NO_FILAMENT, "No filament to calibrate T") \
+    EVENT(LOG_CALIBRATION_HUB_LOADED, "Hub loaded, retract before calibrating") \
+    EVENT(LOG_CALIBRATION_FAILED, "Calibration failed T/cycle ") \
+    EVENT(LOG_CALIBRATION_HYSTERESIS, "Hub hysteresis/deviation um ") \
+    EVENT(LOG_CONFIG_DEFAULTS, "No stored config, using defaults") \
+    EVENT(LOG_CONFIG_LOADED, "Config loaded from slot/hash ") \
+    EVENT(LOG_CONFIG_SAVED, "Config saved to slot/hash ") \
+    EVENT(LOG_SWAPPING, "Swapping T/T ") \
+    EVENT(LOG_SWAPPED, "Swapped in ms ") \
+    EVENT(LOG_SWAP_FAILED, "Swap failed at stage ") \
+    EVENT(LOG_COMMANDS_SKIPPED, "Queued commands skipped after error: ") \
+    EVENT(LOG_FEEDING, "Feeding mm at mm/min ") \
+    EVENT(LOG_FED, "Fed um ") \
+    EVENT(LOG_FEED_REFUSED, "Feed needs filament on the hub") \
+    EVENT(LOG_FEED_LOST_FILAMENT, "Filament left the hub while feeding, um: ") \
+    EVENT(LOG_STEP_RATE_LIMITED, "Step rate limited, requested/max steps/s ") /* retired, no cap until the step ISR is measured */ \
+    EVENT(LOG_ACTION_BUTTON_IGNORED, "Action button ignored while moving, pressed ms ") \
+    EVENT(LOG_EXTRUDED_MICROMETERS, "Extruded um: ") \
+    EVENT(LOG_RETRACTED_MICROMETERS, "Retracted um: ") \
+    EVENT(LOG_SWAP_REFUSED, "Swap refused, slots out of range T/T ") \
+    EVENT(LOG_FEED_INVALID, "Feed refused, invalid mm or mm/min ") \
+    EVENT(LOG_FRAME_TIMEOUT, "Dropped half received frame after silence, sequence ")
+
+#define LOG_EVENT_ID(id, message) id,
+
+enum LogEventId : uint8_t { LOG_EVENTS(LOG_EVENT_ID) LOG_EVENT_COUNT };
+
+#undef LOG_EVENT_ID
+
+enum LogLevel : uint8_t { LOG_LEVEL_DEBUG, LOG_LEVEL_INFO, LOG_LEVEL_WARN, LOG_LEVEL_ERROR };
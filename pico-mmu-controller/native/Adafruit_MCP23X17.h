@@ -0,0 +1,41 @@
+#ifndef NATIVE_ADAFRUIT_MCP23X17_H
+#define NATIVE_ADAFRUIT_MCP23X17_H
+
+#include <stdint.h>
+
+// Expander inputs come from native_hal.cpp, which sets them from the loaded slots and pulls INTA
+// low whenever they change until the next read, like the expander does.
+uint16_t readNativeMcpInputs();
+
+class Adafruit_MCP23X17 {
+   public:
+    bool begin_I2C(uint8_t address = 0x20) {
+        return true;
+    }
+
+    void pinMode(uint8_t pin, uint8_t mode) {}
+
+    void digitalWrite(uint8_t pin, uint8_t value) {
+        if (value) {
+            outputs |= 1U << pin;
+        } else {
+            outputs &= ~(1U << pin);
+        }
+    }
+
+    uint8_t digitalRead(uint8_t pin) {
+        return (readGPIOAB() >> pin) & 1;
+    }
+
+    uint16_t readGPIOAB() {
+        return readNativeMcpInputs();
+    }
+
+    void setupInterrupts(bool mirroring, bool openDrain, uint8_t polarity) {}
+
+    void setupInterruptPin(uint8_t pin, uint8_t mode) {}
+
+    uint16_t outputs = 0;
+};
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef NATIVE_ADAFRUIT_NEOPIXEL_H
+#define NATIVE_ADAFRUIT_NEOPIXEL_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define NATIVE_MAX_PIXELS 64
+
+#define NEO_GRB ((1 << 6) | (1 << 4) | (0 << 2) | (2))
+#define NEO_KHZ800 0x0000
+
+// Keeps the colors in memory, show() only counts frames
+class Adafruit_NeoPixel {
+   public:
+    Adafruit_NeoPixel(uint16_t count, int16_t pin, uint16_t type = NEO_GRB + NEO_KHZ800) : count(count) {
+        clear();
+    }
+
+    void begin() {}
+
+    void show() {
+        frames++;
+    }
+
+    void clear() {
+        memset(colors, 0, sizeof(colors));
+    }
+
+    void setPixelColor(uint16_t index, uint32_t color) {
+        if (index < count && index < NATIVE_MAX_PIXELS) {
+            colors[index] = color;
+        }
+    }
+
+    uint32_t getPixelColor(uint16_t index) const {
+        return index < count && index < NATIVE_MAX_PIXELS ? colors[index] : 0;
+    }
+
+    uint16_t numPixels() const {
+        return count;
+    }
+
+    static uint32_t Color(uint8_t red, uint8_t green, uint8_t blue) {
+        return ((uint32_t)red << 16) | ((uint32_t)green << 8) | blue;
+    }
+
+    unsigned long frames = 0;
+
+   private:
+    uint16_t count;
+    uint32_t colors[NATIVE_MAX_PIXELS];
+};
+
+#endif
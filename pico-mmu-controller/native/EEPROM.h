@@ -0,0 +1,49 @@
+#ifndef NATIVE_EEPROM_H
+#define NATIVE_EEPROM_H
+
+#include <stdint.h>
+
+#define NATIVE_EEPROM_SIZE 1024
+
+// 1 KB like the ATmega328, erased to 0xFF and saved to the --eeprom file on every write
+class EEPROMClass {
+   public:
+    uint8_t read(int address);
+    void write(int address, uint8_t value);
+
+    void update(int address, uint8_t value) {
+        if (read(address) != value) {
+            write(address, value);
+        }
+    }
+
+    uint16_t length() {
+        return NATIVE_EEPROM_SIZE;
+    }
+
+    template <typename T>
+    T& get(int address, T& value) {
+        uint8_t* bytes = (uint8_t*)&value;
+
+        for (unsigned int i = 0; i < sizeof(T); i++) {
+            bytes[i] = read(address + i);
+        }
+
+        return value;
+    }
+
+    template <typename T>
+    const T& put(int address, const T& value) {
+        const uint8_t* bytes = (const uint8_t*)&value;
+
+        for (unsigned int i = 0; i < sizeof(T); i++) {
+            update(address + i, bytes[i]);
+        }
+
+        return value;
+    }
+};
+
+extern EEPROMClass EEPROM;
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef NATIVE_SERVO_H
+#define NATIVE_SERVO_H
+
+#include <stdint.h>
+
+// Remembers the last angle, the servo itself moves instantly
+class Servo {
+   public:
+    uint8_t attach(int pin) {
+        attachedPin = pin;
+        return 0;
+    }
+
+    void detach() {
+        attachedPin = -1;
+    }
+
+    bool attached() {
+        return attachedPin >= 0;
+    }
+
+    void write(int value) {
+        angle = value;
+    }
+
+    int read() {
+        return angle;
+    }
+
+   private:
+    int attachedPin = -1;
+    int angle = 0;
+};
+
+#endif
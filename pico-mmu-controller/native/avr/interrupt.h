@@ -0,0 +1,9 @@
+#ifndef NATIVE_AVR_INTERRUPT_H
+#define NATIVE_AVR_INTERRUPT_H
+
+// Interrupt vectors become plain functions that native_hal.cpp calls when the virtual timer matches
+#define ISR(vector) extern "C" void vector()
+
+extern "C" void TIMER1_COMPB_vect();
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef NATIVE_AVR_IO_H
+#define NATIVE_AVR_IO_H
+
+#include <stdint.h>
+
+// ATmega328 registers the firmware touches directly. Port and pin registers are plain memory that
+// native_hal.cpp reads back to follow the stepper and drives for the hub sensor.
+
+#define _BV(bit) (1 << (bit))
+
+extern volatile uint8_t PORTB, PORTC, PORTD;
+extern volatile uint8_t PINB, PINC, PIND;
+extern volatile uint8_t DDRB, DDRC, DDRD;
+
+// Interrupt flags are cleared by writing a one, like on the chip
+struct NativeFlagRegister {
+    volatile uint8_t value;
+
+    NativeFlagRegister& operator=(uint8_t clear) {
+        value &= ~clear;
+        return *this;
+    }
+
+    operator uint8_t() const {
+        return value;
+    }
+};
+
+#define OCIE1A 1
+#define OCIE1B 2
+#define OCF1A 1
+#define OCF1B 2
+
+extern volatile uint8_t TIMSK1;
+extern NativeFlagRegister TIFR1;
+extern volatile uint16_t OCR1B;
+
+// Timer1 follows the virtual clock, restarting every 20 ms Servo frame
+uint16_t getNativeTimer1Count();
+#define TCNT1 (getNativeTimer1Count())
+
+// No real stack to measure on the host: the heap ends at nativeRam (__brkval) and SP points past it,
+// so the firmware paints and measures this buffer instead
+#define NATIVE_RAM_SIZE 256
+
+extern char nativeRam[NATIVE_RAM_SIZE];
+#define SP ((uintptr_t)(nativeRam + NATIVE_RAM_SIZE))
+
+#endif
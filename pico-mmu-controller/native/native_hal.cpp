@@ -0,0 +1,531 @@
+// Runs the firmware as a Linux process for testing and profiling without a board.
+//
+//   --pty               serve Serial on a pseudo terminal (path printed on stderr) instead of stdin/stdout
+//   --realtime          keep the virtual clock in step with the wall clock, implied by --pty
+//   --eeprom FILE       keep the EEPROM contents in FILE between runs
+//   --filaments MASK    slots with filament loaded, one bit per slot, 0xFF by default
+//   --hub-steps N       steps from the parked filament tip to the hub sensor
+//   --hub-hysteresis N  steps the filament has to back off before the hub sensor releases
+//
+// Time is virtual and moves forward a little on every millis()/micros() call. Timer1 compare B is
+// matched against that clock and calls the stepper interrupt, whose steps move a simulated filament
+// past the hub sensor, which in turn fires the hub interrupt. In stdin mode the process exits
+// shortly after the input ends, so a command script runs as fast as the host allows.
+//
+// Unit test builds (pio test -e native) leave main() to Unity. The tests in test/ point Serial at
+// pipes and run setup() and loop() themselves through the hooks in native_hal.h.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/time.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <Arduino.h>
+#include <EEPROM.h>
+
+#include "board_profile.h"
+#include "native_hal.h"
+
+#define NATIVE_TICKS_PER_MICROSECOND 2
+#define NATIVE_TIMER1_TOP 40000U  // Servo library frame, 20 ms
+#define NATIVE_CALL_TICKS 4       // virtual time every clock read costs
+#define NATIVE_EXIT_DELAY 100     // ms to keep running after stdin ends
+#define NATIVE_OUTPUT_SIZE 256
+#define NATIVE_INPUT_SIZE 256
+
+void setup();
+void loop();
+
+volatile uint8_t PORTB, PORTC, PORTD;
+volatile uint8_t PINB = 0xFF, PINC = 0xFF, PIND = 0xFF;
+volatile uint8_t DDRB, DDRC, DDRD;
+volatile uint8_t TIMSK1;
+NativeFlagRegister TIFR1;
+volatile uint16_t OCR1B;
+
+char nativeRam[NATIVE_RAM_SIZE];
+char __heap_start;
+char* __brkval = nativeRam;
+
+uint16_t nativeMcpInputs = 0xFFFF;
+uint16_t nativeMcpReadInputs = 0xFFFF;  // as of the last read, INTA is low while they differ
+
+HardwareSerial Serial;
+EEPROMClass EEPROM;
+
+uint64_t nativeTicks = 0;
+bool interruptsEnabled = true;
+bool inInterrupt = false;
+bool realtime = false;
+uint64_t startWallMicros = 0;
+
+int inputFd = STDIN_FILENO;
+int outputFd = STDOUT_FILENO;
+bool inputClosed = false;
+unsigned long inputClosedMillis = 0;
+uint8_t inputBuffer[NATIVE_INPUT_SIZE];
+size_t inputLength = 0;
+size_t inputIndex = 0;
+uint8_t outputBuffer[NATIVE_OUTPUT_SIZE];
+size_t outputLength = 0;
+
+uint8_t eepromData[NATIVE_EEPROM_SIZE];
+const char* eepromPath = NULL;
+
+void (*interruptHandlers[2])() = {NULL, NULL};
+
+long filamentPosition = 0;  // steps, positive towards the hub
+long hubSteps = 20000;
+long hubHysteresis = 200;
+bool hubLoaded = false;
+
+uint64_t getWallMicros() {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (uint64_t)now.tv_sec * 1000000ULL + now.tv_usec;
+}
+
+uint16_t getNativeTimer1Count() {
+    return nativeTicks % NATIVE_TIMER1_TOP;
+}
+
+uint64_t getNextCompareMatch() {
+    uint16_t count = getNativeTimer1Count();
+    uint16_t delta = (OCR1B + NATIVE_TIMER1_TOP - count) % NATIVE_TIMER1_TOP;
+
+    return nativeTicks + (delta == 0 ? NATIVE_TIMER1_TOP : delta);
+}
+
+void setHubSensor(bool loaded) {
+    if (loaded == hubLoaded) {
+        return;
+    }
+
+    hubLoaded = loaded;
+
+    // the sensor pulls low with filament in front of it
+    if (loaded) {
+        Board::HubSensorPin::pins() &= ~Board::HubSensorPin::MASK;
+    } else {
+        Board::HubSensorPin::pins() |= Board::HubSensorPin::MASK;
+    }
+
+    void (*handler)() = interruptHandlers[digitalPinToInterrupt(Board::HubSensorPin::NUMBER)];
+
+    if (handler != NULL) {
+        handler();
+    }
+}
+
+// Every compare match is one step, DIR high feeds the filament towards the hub
+void runStepperInterrupt() {
+    inInterrupt = true;
+    TIMER1_COMPB_vect();
+
+    filamentPosition += (Board::DirPin::port() & Board::DirPin::MASK) ? 1 : -1;
+
+    if (filamentPosition >= hubSteps) {
+        setHubSensor(true);
+    } else if (filamentPosition < hubSteps - hubHysteresis) {
+        setHubSensor(false);
+    }
+
+    inInterrupt = false;
+}
+
+void advanceTicks(uint64_t ticks) {
+    if (inInterrupt) {
+        return;
+    }
+
+    uint64_t target = nativeTicks + ticks;
+
+    while (true) {
+        bool enabled = interruptsEnabled && (TIMSK1 & _BV(OCIE1B));
+
+        if (enabled && (TIFR1.value & _BV(OCF1B))) {
+            TIFR1.value &= ~_BV(OCF1B);
+            runStepperInterrupt();
+            continue;
+        }
+
+        uint64_t match = getNextCompareMatch();
+
+        if (match > target) {
+            break;
+        }
+
+        nativeTicks = match;
+        TIFR1.value |= _BV(OCF1B);
+    }
+
+    nativeTicks = target;
+
+    if (realtime) {
+        uint64_t virtualMicros = nativeTicks / NATIVE_TICKS_PER_MICROSECOND;
+        uint64_t wallMicros = getWallMicros() - startWallMicros;
+
+        if (virtualMicros > wallMicros + 1000) {
+            usleep(virtualMicros - wallMicros);
+        }
+    }
+}
+
+unsigned long millis() {
+    advanceTicks(NATIVE_CALL_TICKS);
+    return nativeTicks / (1000ULL * NATIVE_TICKS_PER_MICROSECOND);
+}
+
+unsigned long micros() {
+    advanceTicks(NATIVE_CALL_TICKS);
+    return nativeTicks / NATIVE_TICKS_PER_MICROSECOND;
+}
+
+void delay(unsigned long milliseconds) {
+    advanceTicks((uint64_t)milliseconds * 1000ULL * NATIVE_TICKS_PER_MICROSECOND);
+}
+
+void delayMicroseconds(unsigned int microseconds) {
+    advanceTicks((uint64_t)microseconds * NATIVE_TICKS_PER_MICROSECOND);
+}
+
+void noInterrupts() {
+    interruptsEnabled = false;
+}
+
+void interrupts() {
+    interruptsEnabled = true;
+}
+
+void attachInterrupt(uint8_t interrupt, void (*handler)(), int mode) {
+    if (interrupt < 2) {
+        interruptHandlers[interrupt] = handler;
+    }
+}
+
+void detachInterrupt(uint8_t interrupt) {
+    if (interrupt < 2) {
+        interruptHandlers[interrupt] = NULL;
+    }
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {}
+
+void digitalWrite(uint8_t pin, uint8_t value) {}
+
+int digitalRead(uint8_t pin) {
+    return HIGH;
+}
+
+int analogRead(uint8_t pin) {
+    return 0;
+}
+
+void tone(uint8_t pin, unsigned int frequency, unsigned long duration) {}
+
+void noTone(uint8_t pin) {}
+
+long random(long howBig) {
+    return howBig > 0 ? rand() % howBig : 0;
+}
+
+long random(long howSmall, long howBig) {
+    return howSmall >= howBig ? howSmall : howSmall + random(howBig - howSmall);
+}
+
+void randomSeed(unsigned long seed) {
+    srand(seed);
+}
+
+size_t Print::write(const uint8_t* buffer, size_t size) {
+    size_t written = 0;
+
+    while (size-- > 0) {
+        written += write(*buffer++);
+    }
+
+    return written;
+}
+
+size_t Print::print(const __FlashStringHelper* text) {
+    return write((const char*)text);
+}
+
+size_t Print::print(const char* text) {
+    return write(text);
+}
+
+size_t Print::print(char value) {
+    return write((uint8_t)value);
+}
+
+size_t Print::print(int value, int base) {
+    return print((long)value, base);
+}
+
+size_t Print::print(unsigned int value, int base) {
+    return print((unsigned long)value, base);
+}
+
+size_t Print::print(long value, int base) {
+    if (base == DEC && value < 0) {
+        return print('-') + printNumber(-(unsigned long)value, DEC);
+    }
+
+    return printNumber(value, base);
+}
+
+size_t Print::print(unsigned long value, int base) {
+    return printNumber(value, base);
+}
+
+size_t Print::print(double value, int digits) {
+    char text[32];
+    snprintf(text, sizeof(text), "%.*f", digits, value);
+    return print(text);
+}
+
+size_t Print::println() {
+    return write((const uint8_t*)"\r\n", 2);
+}
+
+size_t Print::printNumber(unsigned long value, uint8_t base) {
+    char text[8 * sizeof(long) + 1];
+    char* cursor = &text[sizeof(text) - 1];
+    *cursor = '\0';
+
+    do {
+        uint8_t digit = value % base;
+        value /= base;
+        *--cursor = digit < 10 ? '0' + digit : 'A' + digit - 10;
+    } while (value > 0);
+
+    return write(cursor);
+}
+
+void HardwareSerial::begin(unsigned long baudRate) {}
+
+void HardwareSerial::end() {
+    flush();
+}
+
+void fillInput() {
+    if (inputIndex < inputLength || inputClosed) {
+        return;
+    }
+
+    ssize_t count = ::read(inputFd, inputBuffer, sizeof(inputBuffer));
+
+    if (count > 0) {
+        inputIndex = 0;
+        inputLength = count;
+    } else if (count == 0 && inputFd == STDIN_FILENO) {
+        inputClosed = true;
+        inputClosedMillis = millis();
+    }
+}
+
+int HardwareSerial::available() {
+    flush();
+    fillInput();
+    return inputLength - inputIndex;
+}
+
+int HardwareSerial::peek() {
+    return available() > 0 ? inputBuffer[inputIndex] : -1;
+}
+
+int HardwareSerial::read() {
+    return available() > 0 ? inputBuffer[inputIndex++] : -1;
+}
+
+int HardwareSerial::availableForWrite() {
+    return NATIVE_OUTPUT_SIZE - outputLength;
+}
+
+void HardwareSerial::flush() {
+    size_t offset = 0;
+
+    while (offset < outputLength) {
+        ssize_t count = ::write(outputFd, outputBuffer + offset, outputLength - offset);
+
+        if (count < 0 && errno != EAGAIN && errno != EINTR) {
+            break;
+        }
+
+        offset += count > 0 ? count : 0;
+    }
+
+    outputLength = 0;
+}
+
+size_t HardwareSerial::write(uint8_t value) {
+    if (outputLength == NATIVE_OUTPUT_SIZE) {
+        flush();
+    }
+
+    outputBuffer[outputLength++] = value;
+
+    // text lines leave right away like on the UART, a command's OK goes out before its work
+    if (value == '\n') {
+        flush();
+    }
+
+    return 1;
+}
+
+uint8_t EEPROMClass::read(int address) {
+    return address >= 0 && address < NATIVE_EEPROM_SIZE ? eepromData[address] : 0xFF;
+}
+
+void EEPROMClass::write(int address, uint8_t value) {
+    if (address < 0 || address >= NATIVE_EEPROM_SIZE) {
+        return;
+    }
+
+    eepromData[address] = value;
+
+    if (eepromPath != NULL) {
+        FILE* file = fopen(eepromPath, "wb");
+
+        if (file != NULL) {
+            fwrite(eepromData, 1, sizeof(eepromData), file);
+            fclose(file);
+        }
+    }
+}
+
+void loadEeprom() {
+    memset(eepromData, 0xFF, sizeof(eepromData));
+
+    FILE* file = eepromPath != NULL ? fopen(eepromPath, "rb") : NULL;
+
+    if (file != NULL) {
+        size_t count = fread(eepromData, 1, sizeof(eepromData), file);
+        fclose(file);
+
+        if (count != sizeof(eepromData)) {
+            memset(eepromData + count, 0xFF, sizeof(eepromData) - count);
+        }
+    }
+}
+
+void updateMcpInterrupt() {
+    if (nativeMcpInputs != nativeMcpReadInputs) {
+        Board::McpInterruptPin::pins() &= ~Board::McpInterruptPin::MASK;
+    } else {
+        Board::McpInterruptPin::pins() |= Board::McpInterruptPin::MASK;
+    }
+}
+
+uint16_t readNativeMcpInputs() {
+    nativeMcpReadInputs = nativeMcpInputs;
+    updateMcpInterrupt();
+    return nativeMcpInputs;
+}
+
+// Filament sensor of slot 1 is MCP pin 15, slot 8 is pin 8, low with filament
+void setLoadedFilaments(unsigned long mask) {
+    for (uint8_t slot = 0; slot < 8; slot++) {
+        uint16_t bit = 1U << (15 - slot);
+
+        if (mask & (1UL << slot)) {
+            nativeMcpInputs &= ~bit;
+        } else {
+            nativeMcpInputs |= bit;
+        }
+    }
+
+    updateMcpInterrupt();
+}
+
+bool openPseudoTerminal() {
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+
+    if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+        perror("posix_openpt");
+        return false;
+    }
+
+    struct termios settings;
+    tcgetattr(master, &settings);
+    cfmakeraw(&settings);
+    tcsetattr(master, TCSANOW, &settings);
+
+    fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+
+    fprintf(stderr, "Serial on %s\n", ptsname(master));
+    inputFd = master;
+    outputFd = master;
+    return true;
+}
+
+bool parseArguments(int argc, char** argv) {
+    bool pty = false;
+    unsigned long filaments = 0xFF;
+
+    for (int i = 1; i < argc; i++) {
+        const char* argument = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if (strcmp(argument, "--pty") == 0) {
+            pty = true;
+            realtime = true;
+        } else if (strcmp(argument, "--realtime") == 0) {
+            realtime = true;
+        } else if (strcmp(argument, "--eeprom") == 0 && value != NULL) {
+            eepromPath = value;
+            i++;
+        } else if (strcmp(argument, "--filaments") == 0 && value != NULL) {
+            filaments = strtoul(value, NULL, 0);
+            i++;
+        } else if (strcmp(argument, "--hub-steps") == 0 && value != NULL) {
+            hubSteps = strtol(value, NULL, 0);
+            i++;
+        } else if (strcmp(argument, "--hub-hysteresis") == 0 && value != NULL) {
+            hubHysteresis = strtol(value, NULL, 0);
+            i++;
+        } else {
+            fprintf(stderr, "Unknown argument %s\n", argument);
+            return false;
+        }
+    }
+
+    if (pty && !openPseudoTerminal()) {
+        return false;
+    }
+
+    if (!pty) {
+        fcntl(STDIN_FILENO, F_SETFL, fcntl(STDIN_FILENO, F_GETFL) | O_NONBLOCK);
+    }
+
+    setLoadedFilaments(filaments);
+    return true;
+}
+
+#ifndef UNIT_TEST
+int main(int argc, char** argv) {
+    if (!parseArguments(argc, argv)) {
+        return 1;
+    }
+
+    loadEeprom();
+    startWallMicros = getWallMicros();
+
+    setup();
+
+    while (!inputClosed || millis() - inputClosedMillis < NATIVE_EXIT_DELAY) {
+        loop();
+
+        // nothing else to do, don't spin a whole core while waiting on the daemon
+        if (realtime && inputIndex == inputLength) {
+            usleep(100);
+        }
+    }
+
+    Serial.flush();
+    return 0;
+}
+#endif
@@ -0,0 +1,15 @@
+#ifndef NATIVE_HAL_H
+#define NATIVE_HAL_H
+
+// Hooks into the mock hardware of native_hal.cpp for the Unity tests in test/, which set the
+// simulated board up and then call the firmware's setup() and loop() themselves.
+
+extern int inputFd;   // Serial reads from here, non-blocking
+extern int outputFd;  // and writes here
+extern long hubSteps;
+extern long hubHysteresis;
+
+void loadEeprom();
+void setLoadedFilaments(unsigned long mask);
+
+#endif
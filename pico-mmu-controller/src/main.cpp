@@ -1,34 +1,84 @@
 #include <Adafruit_MCP23X17.h>
 #include <Adafruit_NeoPixel.h>
 #include <Arduino.h>
+#include <EEPROM.h>
 #include <Servo.h>
+#include <util/crc16.h>
+
+#include "board_profile.h"
+#include "log_events.h"
+
+// Benchmark build: bench/mmu_bench.c runs the image under simavr and counts the cycles between a
+// region ID written to GPIOR1 and the same ID written to GPIOR2, one out instruction each.
+#ifdef MMU_BENCHMARK
+#define BENCH_BEGIN(region) (GPIOR1 = (region))
+#define BENCH_END(region) (GPIOR2 = (region))
+#else
+#define BENCH_BEGIN(region)
+#define BENCH_END(region)
+#endif
+
+#define BENCH_STEPPER_ISR 1
+#define BENCH_INPUT_SCAN 2
+#define BENCH_PIXELS_SHOW 3
+#define BENCH_COMMAND 0x40  // + CommandId
 
 #define LED_PIN 5
 #define BUZZER_PIN 6
 
-#define MMU_DIR_PIN 7
-#define MMU_STEP_PIN 8
-#define MMU_ENABLE_PIN 9
-
-#define MMU_SERVO_PIN 10
-#define CUTTER_SERVO_PIN 3
-
 #define BAUD_RATE 9600
+#define BINARY_CONFIRM_TIMEOUT 2000  // ms to get a valid frame at the negotiated baud rate
+
+// Binary framing: FRAME_START, type, sequence, length, payload, CRC-8 over type..payload
+#define FRAME_START 0xA5
+#define FRAME_PAYLOAD_SIZE 64  // outgoing payloads, longer log lines are truncated
+#define FRAME_PING 0x40        // request types below this are CommandId opcodes
+#define FRAME_ABORT_ON_ERROR 0x20  // opcode flag: an ERROR skips the requests queued behind it
+#define FRAME_LOG 0x80  // packed log records
+#define FRAME_RESPONSE 0x81
+#define FRAME_EVENT 0x82
+#define FRAME_NAK 0x83
+#define FRAME_PENDING 0x84  // a retransmitted request is still queued, its response follows
+#define FRAME_BYTE_TIMEOUT 10  // ms of silence that drops a half received frame
+
+// Requests the host streams ahead wait here while the current one runs. One more than the
+// daemon's pipeline depth, since motion commands answer before they finish.
+#define COMMAND_QUEUE_SIZE 4           // power of two
+#define COMMAND_QUEUE_PAYLOAD_SIZE 32  // longer requests (SYNC) wait in serialLine and run alone
 
 #define MMU_SLOW_PULSE_DELAY 50
-#define MMU_ACCEL_DECEL_SKIP_STEPS 200UL
+#define MMU_DEFAULT_ACCELERATION 800  // mm/s²
+#define MMU_S_CURVE_PROFILE false     // jerk limited ramps instead of constant acceleration
+#define MMU_RAMP_TABLE_SIZE 32
 #define MMU_MOTOR_STEPS 200
 #define MMU_DEFAULT_RPM 500
 #define MMU_MICROSTEPS 64
 #define MMU_MIN_RPM 50
+#define MMU_MIN_MM_PER_ROTATION 1  // keeps steps per mm within Q16.16
 #define MMU_DIRECTION HIGH
 
+#define STEPPER_TICKS_PER_MICROSECOND 2  // Timer1 runs at F_CPU / 8, set up by the Servo library
+#define STEPPER_MIN_LEAD_TICKS 8
+#define STEPPER_STEPS_UNLIMITED 0xFFFFFFFFUL
+#define SERVO_FRAME_TICKS 40000U  // Servo library restarts TCNT1 every 20 ms refresh frame
+#define HUB_EVENT_QUEUE_SIZE 8     // power of two
+
+#define CONFIG_VERSION 1  // bump when StoredConfig changes, older copies are ignored
+#define CONFIG_SLOTS 8    // EEPROM copies written round robin to spread the wear
+
+#define CALIBRATION_CYCLES 5
+#define CALIBRATION_T_95 2.776         // Student t for 95% confidence with CALIBRATION_CYCLES - 1 degrees of freedom
+#define CALIBRATION_RPM 100
+#define CALIBRATION_OVERSHOOT_MM 5     // run past each edge before turning back
+#define CALIBRATION_STUCK_MARGIN_MM 2
+
+#define FEED_DEFAULT_SPEED 2500  // mm/min, the extruder's loading move in pico-mmu.cfg
+#define FEED_MAX_LEAD 5000       // ms a FEED may hold off after its ACK
+
 #define NUM_LEDS 16  // 2 bars of 8 LEDs each
 #define NUMBER_OF_FILAMENTS 8
 #define FILAMENT_RELEASE_OFFSET 2
 
-#define FILAMENT_HUB_SENSOR_PIN 2
-
 #define ACTION_BUTTON_PIN 0
 #define CREALITY_FILAMENT_SENSOR_PIN 1
 
@@ -42,6 +92,22 @@
 #define FILAMENT_EIGHT_SENSOR_PIN 8
 
 #define ALIVE_MESSAGE_INTERVAL 5000
+#define INPUT_DEBOUNCE_TIME 30   // ms an MCP23017 input has to hold a level before it counts
+#define INPUT_POLL_INTERVAL 20   // ms between bank reads on boards without INTA wired
+#define SERIAL_LINE_SIZE 192  // longest line is SYNC with every option
+
+#define MAX_TASKS 8
+#define LOG_BUFFER_SIZE 16
+#define STACK_CANARY 0xC5
+#define STACK_PAINT_MARGIN 32  // bytes below the stack pointer left alone when painting
+#define LOG_RECORDS_PER_FRAME 4  // 15 bytes each, must fit FRAME_PAYLOAD_SIZE
+#define MELODY_QUEUE_SIZE 4
+#define SERVO_DEFAULT_SPEED 300  // degrees per second
+#define SERVO_SETTLE_MARGIN 150  // ms on top of the travel time
+#define SERVO_MAX_ANGLE 180
+#define LED_BLINK_INTERVAL 200
+#define LED_BLINK_TOGGLES 10
+#define LED_FRAME_INTERVAL 20
 
 #define NOTE_A4 440
 #define NOTE_A5 880
@@ -56,34 +122,81 @@
 #define NOTE_E4 330
 #define NOTE_G4 392
 
-const int STARTUP_MELODY[] = {NOTE_C4, NOTE_E4, NOTE_G4, NOTE_C5};
-const int STARTUP_NOTE_DURATIONS[] = {200, 200, 200, 500};
-
-const int ERROR_MELODY[] = {NOTE_A4, NOTE_A4, NOTE_A4};
-const int ERROR_NOTE_DURATIONS[] = {200, 200, 600};
-
-const int FILAMENT_INSERTED_MELODY[] = {NOTE_C5, NOTE_E5, NOTE_G5};
-const int FILAMENT_INSERTED_NOTE_DURATIONS[] = {150, 150, 300};
-
-const int FILAMENT_REMOVED_MELODY[] = {NOTE_G5, NOTE_E5, NOTE_C5};
-const int FILAMENT_REMOVED_NOTE_DURATIONS[] = {150, 150, 300};
-
-const int MARIO_VICTORY_MELODY[] = {
-    NOTE_E5, NOTE_G5, NOTE_C6, NOTE_B5,
-    NOTE_A5, NOTE_F5, NOTE_D5, NOTE_E5};
-
-const int MARIO_VICTORY_NOTE_DURATIONS[] = {
-    150, 150, 300, 300,
-    300, 300, 300, 600};
+struct MelodyNote {
+    uint16_t note;  // Hz, 0 for a rest
+    uint16_t duration;
+};
+
+struct Melody {
+    const MelodyNote* notes;
+    uint8_t length;
+    uint8_t priority;  // a higher priority melody cuts off the one playing
+};
+
+enum MelodyId {
+    STARTUP_MIDI,
+    ERROR_MIDI,
+    FILAMENT_INSERTED_MIDI,
+    FILAMENT_REMOVED_MIDI,
+    MARIO_VICTORY_MIDI,
+    NUMBER_OF_MELODIES
+};
+
+#define MELODY_PRIORITY_LOW 0
+#define MELODY_PRIORITY_NORMAL 1
+#define MELODY_PRIORITY_HIGH 2
+
+const MelodyNote STARTUP_MELODY[] PROGMEM = {
+    {NOTE_C4, 200}, {NOTE_E4, 200}, {NOTE_G4, 200}, {NOTE_C5, 500}};
+
+const MelodyNote ERROR_MELODY[] PROGMEM = {
+    {NOTE_A4, 200}, {NOTE_A4, 200}, {NOTE_A4, 600}};
+
+const MelodyNote FILAMENT_INSERTED_MELODY[] PROGMEM = {
+    {NOTE_C5, 150}, {NOTE_E5, 150}, {NOTE_G5, 300}};
+
+const MelodyNote FILAMENT_REMOVED_MELODY[] PROGMEM = {
+    {NOTE_G5, 150}, {NOTE_E5, 150}, {NOTE_C5, 300}};
+
+const MelodyNote MARIO_VICTORY_MELODY[] PROGMEM = {
+    {NOTE_E5, 150}, {NOTE_G5, 150}, {NOTE_C6, 300}, {NOTE_B5, 300},
+    {NOTE_A5, 300}, {NOTE_F5, 300}, {NOTE_D5, 300}, {NOTE_E5, 600}};
+
+#define MELODY_LENGTH(melody) (sizeof(melody) / sizeof(melody[0]))
+
+// indexed by MelodyId, which is also the number the MIDI command takes
+const Melody MELODIES[NUMBER_OF_MELODIES] PROGMEM = {
+    {STARTUP_MELODY, MELODY_LENGTH(STARTUP_MELODY), MELODY_PRIORITY_NORMAL},
+    {ERROR_MELODY, MELODY_LENGTH(ERROR_MELODY), MELODY_PRIORITY_HIGH},
+    {FILAMENT_INSERTED_MELODY, MELODY_LENGTH(FILAMENT_INSERTED_MELODY), MELODY_PRIORITY_LOW},
+    {FILAMENT_REMOVED_MELODY, MELODY_LENGTH(FILAMENT_REMOVED_MELODY), MELODY_PRIORITY_LOW},
+    {MARIO_VICTORY_MELODY, MELODY_LENGTH(MARIO_VICTORY_MELODY), MELODY_PRIORITY_NORMAL}};
+
+// Step interval multipliers (1/256) over the acceleration ramp, sampled at the middle of each of the
+// MMU_RAMP_TABLE_SIZE equal slices of the ramp length in steps.
+// Constant acceleration: v = sqrt(x), 256 / sqrt((k + 0.5) / 32)
+const uint16_t TRAPEZOIDAL_RAMP_FACTORS[MMU_RAMP_TABLE_SIZE] PROGMEM = {
+    2048, 1182, 916, 774, 683, 617, 568, 529, 497, 470, 447, 427, 410, 394, 380, 368,
+    357, 346, 337, 328, 320, 312, 305, 299, 293, 287, 281, 276, 271, 267, 262, 258};
+
+// Jerk limited: v = 3t² - 2t³ over time, resampled over the position 2 * (t³ - t⁴ / 2)
+const uint16_t S_CURVE_RAMP_FACTORS[MMU_RAMP_TABLE_SIZE] PROGMEM = {
+    2336, 1170, 856, 699, 604, 538, 490, 452, 423, 399, 379, 362, 347, 335, 324, 315,
+    306, 299, 292, 287, 281, 277, 273, 269, 266, 264, 262, 260, 258, 257, 256, 256};
 
 const int FILAMENT_LEDS[] = {0, 3, 5, 7, 8, 11, 13, 15};
 const int FILAMENT_SENSOR_PINS[] = {FILAMENT_ONE_SENSOR_PIN, FILAMENT_TWO_SENSOR_PIN, FILAMENT_THREE_SENSOR_PIN,
                                     FILAMENT_FOUR_SENSOR_PIN, FILAMENT_FIVE_SENSOR_PIN, FILAMENT_SIX_SENSOR_PIN,
                                     FILAMENT_SEVEN_SENSOR_PIN, FILAMENT_EIGHT_SENSOR_PIN};
 
-long ledStates[] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
 bool filamentStates[] = {HIGH, HIGH, HIGH, HIGH, HIGH, HIGH, HIGH, HIGH};
 
+// MCP23017 inputs, bit n is pin n
+uint16_t monitoredInputs = 0;
+uint16_t rawInputs = 0xFFFF;
+uint16_t stableInputs = 0xFFFF;
+uint16_t inputChangeMillis[16];  // low 16 bits of millis() at the last raw change
+
 Adafruit_NeoPixel pixels(NUM_LEDS, LED_PIN);
 Adafruit_MCP23X17 mcp;
 Servo mmuServo;
@@ -93,27 +206,98 @@ int lastColorIndex = -1;
 int lastFilamentLED = -1;
 int lastMMUPosition = 0;
 int activeFilament = -1;
+int selectingFilament = -1;
+
+struct Task {
+    void (*run)();
+    unsigned long interval;  // milliseconds between runs, 0 runs it on every pass
+    unsigned long lastRun;
+    bool running;
+};
+
+Task tasks[MAX_TASKS];
+int taskCount = 0;
+
+int ledTestIndex = -1;
+int ledTestLastIndex = -1;
+int ledTestColorIndex = 0;
+
+struct MelodyRequest {
+    uint8_t melody;
+    bool ledEnabled;
+};
+
+MelodyRequest melodyQueue[MELODY_QUEUE_SIZE];
+int melodyQueueLength = 0;
+
+int currentMelody = -1;
+int melodyIndex = 0;
+int melodyLED = -1;
+uint8_t melodyLEDColor = 0;
+bool melodyLedEnabled = false;
+unsigned long melodyDeadline = 0;
 
 unsigned long previousAliveMessageMillis = 0;
 unsigned long previousStartupBlinkMillis = 0;
 bool startupBlinkState = false;
 
 bool started = false;
-bool hubState = HIGH;
+bool startingUp = false;
+volatile bool hubState = HIGH;
 bool lastHubState = HIGH;
 bool hubStateStucked = false;
 bool autoExtruding = false;
 
-const long BLACK_COLOR = pixels.Color(0, 0, 0);
-const long RED_COLOR = pixels.Color(255, 0, 0);
-const long GREEN_COLOR = pixels.Color(0, 255, 0);
-const long DARK_GREEN_COLOR = pixels.Color(0, 25, 0);
-const long BLUE_COLOR = pixels.Color(0, 0, 255);
-const long YELLOW_COLOR = pixels.Color(255, 255, 0);
-const long WHITE_COLOR = pixels.Color(255, 255, 255);
-const long CYAN_COLOR = pixels.Color(0, 150, 255);
-const long MAGENTA_COLOR = pixels.Color(255, 0, 255);
-const long ORANGE_COLOR = pixels.Color(255, 128, 0);
+enum LedColor : uint8_t {
+    BLACK_COLOR,
+    RED_COLOR,
+    GREEN_COLOR,
+    DARK_GREEN_COLOR,
+    BLUE_COLOR,
+    YELLOW_COLOR,
+    WHITE_COLOR,
+    CYAN_COLOR,
+    MAGENTA_COLOR,
+    ORANGE_COLOR,
+    LED_TRANSPARENT = 0xFF  // layer shows what is below it
+};
+
+// indexed by LedColor, 0xRRGGBB as Adafruit_NeoPixel::Color() packs it
+const uint32_t LED_PALETTE[] PROGMEM = {
+    0x000000, 0xFF0000, 0x00FF00, 0x001900, 0x0000FF,
+    0xFFFF00, 0xFFFFFF, 0x0096FF, 0xFF00FF, 0xFF8000};
+
+const uint8_t MUSIC_COLORS[] = {RED_COLOR, GREEN_COLOR, BLUE_COLOR, YELLOW_COLOR,
+                                WHITE_COLOR, CYAN_COLOR, MAGENTA_COLOR, ORANGE_COLOR};
+const int NUMBER_OF_MUSIC_COLORS = sizeof(MUSIC_COLORS) / sizeof(MUSIC_COLORS[0]);
+
+const uint8_t TEST_LED_COLORS[] = {RED_COLOR, GREEN_COLOR, BLUE_COLOR, YELLOW_COLOR,
+                                   CYAN_COLOR, MAGENTA_COLOR, ORANGE_COLOR, WHITE_COLOR};
+const int NUMBER_OF_TEST_LED_COLORS = sizeof(TEST_LED_COLORS) / sizeof(TEST_LED_COLORS[0]);
+
+uint8_t ledFrame[NUMBER_OF_FILAMENTS] = {BLACK_COLOR, BLACK_COLOR, BLACK_COLOR, BLACK_COLOR,
+                                         BLACK_COLOR, BLACK_COLOR, BLACK_COLOR, BLACK_COLOR};
+uint8_t effectColors[NUMBER_OF_FILAMENTS] = {LED_TRANSPARENT, LED_TRANSPARENT, LED_TRANSPARENT, LED_TRANSPARENT,
+                                             LED_TRANSPARENT, LED_TRANSPARENT, LED_TRANSPARENT, LED_TRANSPARENT};
+uint8_t blinkColors[NUMBER_OF_FILAMENTS] = {LED_TRANSPARENT, LED_TRANSPARENT, LED_TRANSPARENT, LED_TRANSPARENT,
+                                            LED_TRANSPARENT, LED_TRANSPARENT, LED_TRANSPARENT, LED_TRANSPARENT};
+unsigned long blinkStartMillis[NUMBER_OF_FILAMENTS];
+
+struct ServoMotion {
+    Servo* servo;
+    uint8_t pin;
+    int position;  // last commanded angle, -1 until the first move
+    int startPosition;
+    int target;
+    unsigned long startMillis;
+    unsigned long deadline;  // detach time once the target was commanded
+    bool moving;
+    bool slewing;
+    uint8_t operation;  // ASYNC move to report with DONE, 0 for none
+};
+
+ServoMotion mmuServoMotion = {&mmuServo, Board::MmuServoPin::NUMBER, -1, 0, 0, 0, 0, false, false, 0};
+ServoMotion cutterServoMotion = {&cutterServo, Board::CutterServoPin::NUMBER, -1, 0, 0, 0, 0, false, false, 0};
 
 // config from machine
 // default, change it in printer config
@@ -121,919 +305,3111 @@ int filamentPositions[] = {170, 148, 126, 104, 80, 56, 32, 10};
 long extrudeMilimeters = 32;
 long retractMilimeters = 60;
 long milimetersToStuck = 80;
-double milimetersPerRotation = 18.28571429;
+unsigned long nanometersPerRotation = 18285714;
+long servoDegreesPerSecond = SERVO_DEFAULT_SPEED;
+bool servoSlewEnabled = false;
+long milimetersAcceleration = MMU_DEFAULT_ACCELERATION;
+
+// Q16.16 scales derived from nanometersPerRotation once per SYNC, so moves only multiply and shift
+unsigned long stepsPerMilimeter;
+unsigned long micrometersPerStep;
+long stepperResidual = 0;  // Q16 steps commanded but not run yet, positive towards extruding
+
+// Synced config as persisted in EEPROM, the newest valid copy is loaded on boot
+struct StoredConfig {
+    uint8_t version;
+    uint8_t sequence;  // incremented on every write, wrapping
+    uint16_t hash;     // of the SYNC arguments it came from
+    int filamentPositions[NUMBER_OF_FILAMENTS];
+    long extrudeMilimeters;
+    long retractMilimeters;
+    long milimetersToStuck;
+    unsigned long nanometersPerRotation;
+    long milimetersAcceleration;
+    long servoDegreesPerSecond;
+    bool servoSlewEnabled;
+    uint8_t crc;  // CRC-8 over everything above
+};
+
+uint16_t configHash = 0;  // 0 while running on the defaults
+int8_t configSlot = -1;
+uint8_t configSequence = 0;
+
+// Performance counters since the last STATS_RESET
+struct PerformanceStats {
+    unsigned long resetMillis;
+    unsigned long loopCount;
+    unsigned long loopMaxMicros;
+    unsigned long sensorReads;
+    unsigned long i2cTransactions;
+    unsigned long i2cTotalMicros;
+    unsigned long i2cMaxMicros;  // longest input scan
+    unsigned long requestedStepRate;  // steps/s of the last move
+    unsigned long achievedStepRate;
+    unsigned long logRecordsDropped;  // overwritten before a LOG_DUMP got them out
+};
+
+PerformanceStats stats;
+unsigned long lastLoopMicros = 0;
+volatile unsigned long hubInterruptCount = 0;
+volatile unsigned int stepperMaxLateTicks = 0;  // how long after its compare a step fired
+volatile unsigned int stepperCatchUps = 0;
+
+extern char __heap_start;
+extern char* __brkval;
+
+char serialLine[SERIAL_LINE_SIZE];
+uint8_t serialLineLength = 0;
+bool serialLineOverflow = false;
+
+enum FrameState : uint8_t { FRAME_WAIT_START, FRAME_WAIT_TYPE, FRAME_WAIT_SEQUENCE, FRAME_WAIT_LENGTH, FRAME_WAIT_PAYLOAD, FRAME_WAIT_CRC };
+
+FrameState frameState = FRAME_WAIT_START;
+uint8_t frameType = 0;
+uint8_t frameSequence = 0;
+uint8_t frameLength = 0;
+uint8_t frameCrc = 0;
+unsigned long frameByteMillis = 0;
+bool binaryConfirmed = false;
+unsigned long binaryStartMillis = 0;
+
+uint8_t requestSequence = 0;  // 0 for text commands
+
+struct QueuedCommand {
+    uint8_t type;
+    uint8_t sequence;
+    char payload[COMMAND_QUEUE_PAYLOAD_SIZE];
+};
+
+QueuedCommand commandQueue[COMMAND_QUEUE_SIZE];
+uint8_t commandQueueHead = 0;  // next free slot
+uint8_t commandQueueCount = 0;  // includes the one running
+bool frameHeld = false;         // a complete request waits in serialLine, reading stops until it moves
+bool commandFailed = false;
+bool commandRunning = false;  // tasks run from inside commands, nothing there may start motion
+
+// Recent answers by sequence, repeated when the host retransmits a request it got no answer for
+struct SentResponse {
+    uint8_t sequence;
+    uint8_t operation;
+    const __FlashStringHelper* response;
+};
+
+SentResponse sentResponses[COMMAND_QUEUE_SIZE];
+uint8_t sentResponseIndex = 0;
+
+// Motion commands are answered "OK OP=<id>" once accepted and finish with a DONE <id> event
+uint8_t operationId = 0;  // last one handed out, 1..255
+
+// Everything sent to the host goes through here: plain lines in text mode, one frame per message
+// in binary mode so the daemon can tell responses from logs.
+class SerialLink : public Print {
+   public:
+    bool binary = false;
+
+    void beginMessage(uint8_t type, uint8_t sequence) {
+        messageType = type;
+        messageSequence = sequence;
+        messageLength = 0;
+    }
 
-void logInfo(const String& message, const String& extra) {
-    Serial.print("[");
-    Serial.print(millis());
-    Serial.print("] INFO - ");
-    Serial.print(message);
-    Serial.println(extra);
-}
+    void endMessage() {
+        if (!binary) {
+            Serial.println();
+            return;
+        }
 
-void logWarn(const String& message, const String& extra) {
-    Serial.print("[");
-    Serial.print(millis());
-    Serial.print("] WARN - ");
-    Serial.print(message);
-    Serial.println(extra);
-}
+        uint8_t crc = 0;
 
-void logError(const String& message, const String& extra) {
-    Serial.print("[");
-    Serial.print(millis());
-    Serial.print("] ERROR - ");
-    Serial.print(message);
-    Serial.println(extra);
-}
+        Serial.write(FRAME_START);
+        crc = writeFrameByte(messageType, crc);
+        crc = writeFrameByte(messageSequence, crc);
+        crc = writeFrameByte(messageLength, crc);
 
-void responseOk() {
-    Serial.println("OK");
-}
+        for (uint8_t i = 0; i < messageLength; i++) {
+            crc = writeFrameByte(payload[i], crc);
+        }
 
-void responseError() {
-    Serial.println("ERROR");
-}
+        Serial.write(crc);
+    }
 
-void responseAlive() {
-    Serial.println("ALIVE");
-}
+    using Print::write;
 
-void changeLED(int index, long color) {
-    int position = FILAMENT_LEDS[index];
+    size_t write(uint8_t value) override {
+        if (!binary) {
+            return Serial.write(value);
+        }
 
-    pixels.setPixelColor(position, color);
-    pixels.show();
-}
+        if (messageLength < FRAME_PAYLOAD_SIZE) {
+            payload[messageLength++] = value;
+        }
+
+        return 1;
+    }
 
-void blinkLED(int index, long color) {
-    for (int i = 0; i < 5; i++) {
-        changeLED(index, color);
-        delay(200);
+   private:
+    uint8_t messageType = 0;
+    uint8_t messageSequence = 0;
+    uint8_t messageLength = 0;
+    uint8_t payload[FRAME_PAYLOAD_SIZE];
 
-        changeLED(index, BLACK_COLOR);
-        delay(200);
+    uint8_t writeFrameByte(uint8_t value, uint8_t crc) {
+        Serial.write(value);
+        return _crc8_ccitt_update(crc, value);
+    }
+};
+
+SerialLink serialLink;
+
+// Log events are recorded in RAM and only leave the board on LOG_DUMP, so logging costs a few
+// microseconds on the hot path instead of a blocking serial line.
+struct LogRecord {
+    unsigned long timestamp;
+    uint8_t event;
+    uint8_t level;
+    uint8_t argumentCount;
+    long arguments[2];
+};
+
+#define LOG_EVENT_MESSAGE(id, message) const char id##_MESSAGE[] PROGMEM = message;
+LOG_EVENTS(LOG_EVENT_MESSAGE)
+#undef LOG_EVENT_MESSAGE
+
+#define LOG_EVENT_MESSAGE_POINTER(id, message) id##_MESSAGE,
+const char* const LOG_MESSAGES[LOG_EVENT_COUNT] PROGMEM = {LOG_EVENTS(LOG_EVENT_MESSAGE_POINTER)};
+#undef LOG_EVENT_MESSAGE_POINTER
+
+LogRecord logRecords[LOG_BUFFER_SIZE];
+uint8_t logHead = 0;  // next record to write
+uint8_t logCount = 0;
+uint16_t logOverwritten = 0;
+uint8_t logLevel = LOG_LEVEL_INFO;
+
+void logEvent(uint8_t level, LogEventId event, uint8_t argumentCount, long first = 0, long second = 0) {
+    if (level < logLevel) {
+        return;
     }
 
-    changeLED(index, color);
-}
+    LogRecord& record = logRecords[logHead];
+    record.timestamp = millis();
+    record.event = event;
+    record.level = level;
+    record.argumentCount = argumentCount;
+    record.arguments[0] = first;
+    record.arguments[1] = second;
 
-void disableLEDs() {
-    for (int i = 0; i < NUM_LEDS; i++) {
-        pixels.setPixelColor(i, BLACK_COLOR);
-        pixels.show();
+    logHead = (logHead + 1) % LOG_BUFFER_SIZE;
+
+    if (logCount < LOG_BUFFER_SIZE) {
+        logCount++;
+    } else {
+        logOverwritten++;  // the oldest record is lost
+        stats.logRecordsDropped++;
     }
 }
 
-void startupLEDs() {
-    for (int i = 0; i < NUMBER_OF_FILAMENTS; i++) {
-        changeLED(i, CYAN_COLOR);
-        delay(100);
-    }
+template <typename... Arguments>
+void logDebug(LogEventId event, Arguments... arguments) {
+    static_assert(sizeof...(arguments) <= 2, "log events take up to two arguments");
+    logEvent(LOG_LEVEL_DEBUG, event, sizeof...(arguments), static_cast<long>(arguments)...);
 }
 
-void finishStartupLEDs() {
-    for (int i = NUMBER_OF_FILAMENTS - 1; i >= 0; i--) {
-        changeLED(i, BLACK_COLOR);
-        delay(100);
-    }
+template <typename... Arguments>
+void logInfo(LogEventId event, Arguments... arguments) {
+    static_assert(sizeof...(arguments) <= 2, "log events take up to two arguments");
+    logEvent(LOG_LEVEL_INFO, event, sizeof...(arguments), static_cast<long>(arguments)...);
 }
 
-void blinkStartupLEDs() {
-    unsigned long currentMillis = millis();
-    if (currentMillis - previousStartupBlinkMillis >= 500) {
-        previousStartupBlinkMillis = currentMillis;
-        startupBlinkState = !startupBlinkState;
+template <typename... Arguments>
+void logWarn(LogEventId event, Arguments... arguments) {
+    static_assert(sizeof...(arguments) <= 2, "log events take up to two arguments");
+    logEvent(LOG_LEVEL_WARN, event, sizeof...(arguments), static_cast<long>(arguments)...);
+}
 
-        for (int i = 0; i < NUMBER_OF_FILAMENTS; i++) {
-            changeLED(i, BLACK_COLOR);
-            if (startupBlinkState) {
-                changeLED(i, ORANGE_COLOR);
-            } else {
-                changeLED(i, BLACK_COLOR);
-            }
-        }
+template <typename... Arguments>
+void logError(LogEventId event, Arguments... arguments) {
+    static_assert(sizeof...(arguments) <= 2, "log events take up to two arguments");
+    logEvent(LOG_LEVEL_ERROR, event, sizeof...(arguments), static_cast<long>(arguments)...);
+}
+
+const __FlashStringHelper* getLogLevelName(uint8_t level) {
+    switch (level) {
+        case LOG_LEVEL_DEBUG:
+            return F("] DEBUG - ");
+        case LOG_LEVEL_WARN:
+            return F("] WARN - ");
+        case LOG_LEVEL_ERROR:
+            return F("] ERROR - ");
+        default:
+            return F("] INFO - ");
     }
 }
 
-void blinkErrorLEDs() {
-    while (true) {
-        for (int i = 0; i < NUMBER_OF_FILAMENTS; i++) {
-            changeLED(i, RED_COLOR);
-        }
-        delay(500);
+void printLogRecord(const LogRecord& record) {
+    serialLink.beginMessage(FRAME_LOG, 0);
+    serialLink.print('[');
+    serialLink.print(record.timestamp);
+    serialLink.print(getLogLevelName(record.level));
+    serialLink.print((const __FlashStringHelper*)pgm_read_ptr(&LOG_MESSAGES[record.event]));
 
-        for (int i = 0; i < NUMBER_OF_FILAMENTS; i++) {
-            changeLED(i, BLACK_COLOR);
+    for (uint8_t i = 0; i < record.argumentCount; i++) {
+        if (i > 0) {
+            serialLink.print(' ');
         }
-        delay(500);
+        serialLink.print(record.arguments[i]);
     }
+
+    serialLink.endMessage();
 }
 
-void saveLEDStates() {
-    for (int i = 0; i < NUM_LEDS; i++) {
-        ledStates[i] = pixels.getPixelColor(i);
+void writeLogValue(uint32_t value, uint8_t size) {
+    for (uint8_t i = 0; i < size; i++) {
+        serialLink.write((uint8_t)(value >> (8 * i)));
     }
 }
 
-void restoreLEDStates() {
-    for (int i = 0; i < NUM_LEDS; i++) {
-        pixels.setPixelColor(i, ledStates[i]);
-    }
-    pixels.show();
+// Binary dump record: timestamp (4), event, level, argument count, 2 arguments (4 each), little endian
+void writeLogRecord(const LogRecord& record) {
+    writeLogValue(record.timestamp, 4);
+    writeLogValue(record.event, 1);
+    writeLogValue(record.level, 1);
+    writeLogValue(record.argumentCount, 1);
+    writeLogValue(record.arguments[0], 4);
+    writeLogValue(record.arguments[1], 4);
 }
 
-void changeMusicLED(int index) {
-    long color;
-    int currentColorIndex;
+void dumpLogRecord(const LogRecord& record, uint8_t& recordsInFrame) {
+    if (!serialLink.binary) {
+        printLogRecord(record);
+        return;
+    }
 
-    do {
-        currentColorIndex = random(0, 7);
-    } while (currentColorIndex == lastColorIndex);
+    if (recordsInFrame == 0) {
+        serialLink.beginMessage(FRAME_LOG, 0);
+    }
 
-    lastColorIndex = currentColorIndex;
+    writeLogRecord(record);
 
-    switch (currentColorIndex) {
-        case 0:
-            color = RED_COLOR;
-            break;
-        case 1:
-            color = GREEN_COLOR;
-            break;
-        case 2:
-            color = BLUE_COLOR;
-            break;
-        case 3:
-            color = YELLOW_COLOR;
-            break;
-        case 4:
-            color = WHITE_COLOR;
-            break;
-        case 5:
-            color = CYAN_COLOR;
-            break;
-        case 6:
-            color = MAGENTA_COLOR;
-            break;
-        case 7:
-            color = ORANGE_COLOR;
-            break;
+    if (++recordsInFrame == LOG_RECORDS_PER_FRAME) {
+        serialLink.endMessage();
+        recordsInFrame = 0;
     }
-
-    changeLED(index, color);
 }
 
-void buttonClickSound() {
-    int clickDuration = 50;
-
-    tone(BUZZER_PIN, NOTE_C6, clickDuration);
-    delay(clickDuration * 1.3);
-    noTone(BUZZER_PIN);
-}
+void dumpLogs() {
+    uint8_t recordsInFrame = 0;
 
-void playMIDI(const int* melody, const int* noteDurations, int notes, bool ledEnabled) {
-    if (ledEnabled) {
-        saveLEDStates();
-        disableLEDs();
+    if (logOverwritten > 0) {
+        LogRecord overwritten = {millis(), LOG_RECORDS_OVERWRITTEN, LOG_LEVEL_WARN, 1, {logOverwritten, 0}};
+        dumpLogRecord(overwritten, recordsInFrame);
+        logOverwritten = 0;
     }
 
-    for (int thisNote = 0; thisNote < notes; thisNote++) {
-        int noteDuration = noteDurations[thisNote];
-        int note = melody[thisNote];
+    uint8_t index = (logHead + LOG_BUFFER_SIZE - logCount) % LOG_BUFFER_SIZE;
 
-        int filamentLED;
+    while (logCount > 0) {
+        dumpLogRecord(logRecords[index], recordsInFrame);
 
-        do {
-            filamentLED = random(0, NUMBER_OF_FILAMENTS - 1);
-        } while (filamentLED == lastFilamentLED);
-
-        lastFilamentLED = filamentLED;
-
-        if (note == 0) {
-            noTone(BUZZER_PIN);
-        } else {
-            tone(BUZZER_PIN, note, noteDuration);
+        index = (index + 1) % LOG_BUFFER_SIZE;
+        logCount--;
+    }
 
-            if (ledEnabled) {
-                changeMusicLED(filamentLED);
-            }
-        }
+    if (recordsInFrame > 0) {
+        serialLink.endMessage();
+    }
+}
 
-        delay(noteDuration * 1.3);
+void writeResponse(uint8_t sequence, const __FlashStringHelper* response, uint8_t operation = 0) {
+    serialLink.beginMessage(FRAME_RESPONSE, sequence);
+    serialLink.print(response);
 
-        if (ledEnabled) {
-            changeLED(filamentLED, BLACK_COLOR);
-        }
+    if (operation != 0) {
+        serialLink.print(F(" OP="));
+        serialLink.print(operation);
     }
 
-    noTone(BUZZER_PIN);
+    serialLink.endMessage();
+}
 
-    if (ledEnabled) {
-        restoreLEDStates();
+// The ring goes out first: the daemon doesn't poll while requests are pending, and one
+// command can log about as much as the ring holds
+void sendResponse(const __FlashStringHelper* response, uint8_t operation = 0) {
+    dumpLogs();
+    writeResponse(requestSequence, response, operation);
+
+    if (requestSequence != 0) {
+        sentResponses[sentResponseIndex].sequence = requestSequence;
+        sentResponses[sentResponseIndex].operation = operation;
+        sentResponses[sentResponseIndex].response = response;
+        sentResponseIndex = (sentResponseIndex + 1) % COMMAND_QUEUE_SIZE;
     }
 }
 
-void startupMIDI(bool ledEnabled) {
-    int notes = sizeof(STARTUP_MELODY) / sizeof(STARTUP_MELODY[0]);
-    playMIDI(STARTUP_MELODY, STARTUP_NOTE_DURATIONS, notes, ledEnabled);
+void sendEvent(const __FlashStringHelper* event) {
+    serialLink.beginMessage(FRAME_EVENT, 0);
+    serialLink.print(event);
+    serialLink.endMessage();
 }
 
-void errorMIDI(bool ledEnabled) {
-    int notes = sizeof(ERROR_MELODY) / sizeof(ERROR_MELODY[0]);
-    playMIDI(ERROR_MELODY, ERROR_NOTE_DURATIONS, notes, ledEnabled);
+void sendConfigEvent(const __FlashStringHelper* event) {
+    serialLink.beginMessage(FRAME_EVENT, 0);
+    serialLink.print(event);
+    serialLink.print(F(" CONFIG="));
+    serialLink.print(configHash, HEX);
+    serialLink.endMessage();
 }
 
-void filamentInsertedMIDI(bool ledEnabled) {
-    int notes = sizeof(FILAMENT_INSERTED_MELODY) / sizeof(FILAMENT_INSERTED_MELODY[0]);
-    playMIDI(FILAMENT_INSERTED_MELODY, FILAMENT_INSERTED_NOTE_DURATIONS, notes, ledEnabled);
+void responseOk() {
+    sendResponse(F("OK"));
 }
 
-void filamentRemovedMIDI(bool ledEnabled) {
-    int notes = sizeof(FILAMENT_REMOVED_MELODY) / sizeof(FILAMENT_REMOVED_MELODY[0]);
-    playMIDI(FILAMENT_REMOVED_MELODY, FILAMENT_REMOVED_NOTE_DURATIONS, notes, ledEnabled);
+void responseError() {
+    commandFailed = true;
+    sendResponse(F("ERROR"));
 }
 
-void marioVictoryMIDI(bool ledEnabled) {
-    int notes = sizeof(MARIO_VICTORY_MELODY) / sizeof(MARIO_VICTORY_MELODY[0]);
-    playMIDI(MARIO_VICTORY_MELODY, MARIO_VICTORY_NOTE_DURATIONS, notes, ledEnabled);
+// ACK of a motion command, the work runs after it
+uint8_t acceptOperation() {
+    operationId = operationId % 255 + 1;
+    sendResponse(F("OK"), operationId);
+    return operationId;
 }
 
-bool playMIDI(int position) {
-    switch (position) {
-        case 0:
-            startupMIDI(true);
-            return true;
-
-        case 1:
-            errorMIDI(true);
-            return true;
+void responseAlive() {
+    sendEvent(F("ALIVE"));
+}
 
-        case 2:
-            filamentInsertedMIDI(true);
-            return true;
+// Cooperative scheduler: every background job is a task that checks its own deadline and returns
+// right away. Anything waiting on hardware keeps calling runTasks() instead of delay().
+void runTasks() {
+    unsigned long currentMillis = millis();
 
-        case 3:
-            filamentRemovedMIDI(true);
-            return true;
+    for (int i = 0; i < taskCount; i++) {
+        Task& task = tasks[i];
 
-        case 4:
-            marioVictoryMIDI(true);
-            return true;
+        // a task still running further up the stack is skipped instead of re-entered
+        if (task.running || currentMillis - task.lastRun < task.interval) {
+            continue;
+        }
 
-        default:
-            logError(F("Unknown MIDI "), String(position));
+        task.running = true;
+        task.lastRun = currentMillis;
+        task.run();
+        task.running = false;
     }
-
-    return false;
-}
-
-void setMissingFilament() {
-    logInfo(F("Setting missing filament, pausing print"), "");
-    mcp.digitalWrite(CREALITY_FILAMENT_SENSOR_PIN, HIGH);
 }
 
-void unsetMissingFilament() {
-    mcp.digitalWrite(CREALITY_FILAMENT_SENSOR_PIN, LOW);
-}
+bool addTask(void (*run)(), unsigned long interval) {
+    if (taskCount >= MAX_TASKS) {
+        return false;
+    }
 
-void changeHubState() {
-    // Read raw pin state directly
-    hubState = (PIND & (1 << FILAMENT_HUB_SENSOR_PIN));
-    hubStateStucked = false;
-}
+    tasks[taskCount].run = run;
+    tasks[taskCount].interval = interval;
+    tasks[taskCount].lastRun = 0;
+    tasks[taskCount].running = false;
+    taskCount++;
 
-long getDegreesFromMilimeters(long milimeters) {
-    return milimeters * 360 / milimetersPerRotation;
+    return true;
 }
 
-long getStepsFromDegrees(long degrees) {
-    return degrees * (unsigned long)MMU_MICROSTEPS * (unsigned long)MMU_MOTOR_STEPS / 360UL;
-}
+void waitMillis(unsigned long milliseconds) {
+    unsigned long startMillis = millis();
 
-long getStepsFromMilimeters(long milimeters) {
-    long degrees = getDegreesFromMilimeters(milimeters);
-    return getStepsFromDegrees(degrees);
+    while (millis() - startMillis < milliseconds) {
+        runTasks();
+    }
 }
 
-long getMilimetersFromSteps(unsigned long steps) {
-    long degrees = steps * 360UL / (MMU_MICROSTEPS * MMU_MOTOR_STEPS);
-    return degrees * milimetersPerRotation / 360;
+uint32_t getPaletteColor(uint8_t color) {
+    return pgm_read_dword(&LED_PALETTE[color]);
 }
 
-void setCutterServoPosition(int position) {
-    cutterServo.attach(CUTTER_SERVO_PIN);
-    cutterServo.write(position);
-    delay(1000);
-    cutterServo.detach();
-}
+// Base layer: what the slot state says, shown whenever nothing is drawn on top of it
+uint8_t getSlotColor(int index) {
+    if (index == selectingFilament) {
+        return WHITE_COLOR;
+    }
 
-void setMMUServoPosition(int position) {
-    lastMMUPosition = position;
+    if (!started) {
+        return BLACK_COLOR;
+    }
 
-    mmuServo.attach(MMU_SERVO_PIN);
-    mmuServo.write(position);
-    delay(1000);
-    mmuServo.detach();
-}
+    bool present = filamentStates[index] == LOW;
 
-void testLED(int index) {
-    logInfo(F("Testing LED "), String(index + 1));
+    if (index != activeFilament) {
+        return present ? CYAN_COLOR : BLACK_COLOR;
+    } else if (!present) {
+        return RED_COLOR;
+    } else if (hubStateStucked) {
+        return ORANGE_COLOR;
+    } else if (hubState == HIGH) {
+        return DARK_GREEN_COLOR;
+    }
 
-    blinkLED(index, RED_COLOR);
-    blinkLED(index, GREEN_COLOR);
-    blinkLED(index, BLUE_COLOR);
-    blinkLED(index, YELLOW_COLOR);
-    blinkLED(index, CYAN_COLOR);
-    blinkLED(index, MAGENTA_COLOR);
-    blinkLED(index, ORANGE_COLOR);
-    blinkLED(index, WHITE_COLOR);
+    return GREEN_COLOR;
 }
 
-void safeTestLED(int index) {
-    logInfo(F("Testing LEDs"), "");
+void blinkLED(int index, uint8_t color) {
+    blinkColors[index] = color;
+    blinkStartMillis[index] = millis();
+}
 
-    saveLEDStates();
-    testLED(index);
-    restoreLEDStates();
+bool isBlinkingLED(int index) {
+    return blinkColors[index] != LED_TRANSPARENT &&
+           millis() - blinkStartMillis[index] < LED_BLINK_INTERVAL * LED_BLINK_TOGGLES;
 }
 
-void testLEDs() {
-    logInfo(F("Testing LEDs"), "");
+uint8_t getBlinkColor(int index) {
+    if (!isBlinkingLED(index)) {
+        blinkColors[index] = LED_TRANSPARENT;
+        return LED_TRANSPARENT;
+    }
 
-    saveLEDStates();
+    unsigned long phase = (millis() - blinkStartMillis[index]) / LED_BLINK_INTERVAL;
 
-    for (int i = 0; i < NUMBER_OF_FILAMENTS; i++) {
-        testLED(i);
+    if (phase % 2 == 0) {
+        return blinkColors[index];
     }
 
-    restoreLEDStates();
+    return BLACK_COLOR;
 }
 
-bool setFilament(int index) {
-    activeFilament = index;
+void setEffectLED(int index, uint8_t color) {
+    effectColors[index] = color;
+}
 
+void fillEffectLEDs(uint8_t color) {
     for (int i = 0; i < NUMBER_OF_FILAMENTS; i++) {
-        bool filamentState = filamentStates[i];
-
-        if (filamentState == LOW) {
-            changeLED(i, CYAN_COLOR);
-        } else {
-            changeLED(i, BLACK_COLOR);
-        }
+        effectColors[i] = color;
     }
-    changeLED(activeFilament, WHITE_COLOR);
-
-    bool filamentState = filamentStates[activeFilament];
-    int position = filamentPositions[activeFilament];
-
-    setMMUServoPosition(position);
-
-    if (filamentState == LOW) {
-        unsetMissingFilament();
+}
 
-        if (hubStateStucked) {
-            changeLED(activeFilament, ORANGE_COLOR);
-        } else if (hubState == HIGH) {
-            changeLED(activeFilament, DARK_GREEN_COLOR);
-        } else {
-            changeLED(activeFilament, GREEN_COLOR);
+// Layers from the top: music lights, effects (startup), blinks, slot state
+uint8_t composeLED(int index) {
+    if (currentMelody > -1 && melodyLedEnabled) {
+        if (index == melodyLED) {
+            return melodyLEDColor;
         }
 
-    } else {
-        changeLED(activeFilament, RED_COLOR);
-        errorMIDI(false);
-        blinkLED(activeFilament, RED_COLOR);
-        return false;
+        return BLACK_COLOR;
     }
 
-    return true;
-}
-
-void filamentRelease() {
-    saveLEDStates();
+    if (effectColors[index] != LED_TRANSPARENT) {
+        return effectColors[index];
+    }
 
-    if (lastMMUPosition > 90) {
-        changeLED(7, WHITE_COLOR);
-        setMMUServoPosition(filamentPositions[7]);
+    uint8_t blinkColor = getBlinkColor(index);
 
-    } else {
-        changeLED(0, WHITE_COLOR);
-        setMMUServoPosition(filamentPositions[0]);
+    if (blinkColor != LED_TRANSPARENT) {
+        return blinkColor;
     }
 
-    restoreLEDStates();
+    return getSlotColor(index);
 }
 
-bool swapFinish() {
-    if (hubStateStucked || filamentStates[activeFilament] == HIGH) {
-        setMissingFilament();
-        errorMIDI(false);
-        return false;
+void startupLEDs() {
+    for (int i = 0; i < NUMBER_OF_FILAMENTS; i++) {
+        setEffectLED(i, CYAN_COLOR);
+        waitMillis(100);
     }
-
-    return true;
 }
 
-unsigned long rotateMmu(long degrees, int rpm, bool accelerationEnabled, bool decelerationEnabled, bool resetOnSensor) {
-    if (degrees == 0) {
-        return 0;
+void finishStartupLEDs() {
+    for (int i = NUMBER_OF_FILAMENTS - 1; i >= 0; i--) {
+        setEffectLED(i, BLACK_COLOR);
+        waitMillis(100);
     }
+}
 
-    digitalWrite(MMU_ENABLE_PIN, LOW);
+void blinkStartupLEDs() {
+    unsigned long currentMillis = millis();
+    if (currentMillis - previousStartupBlinkMillis >= 500) {
+        previousStartupBlinkMillis = currentMillis;
+        startupBlinkState = !startupBlinkState;
 
-    if (degrees < 0) {
-        digitalWrite(MMU_DIR_PIN, !MMU_DIRECTION);
-        degrees *= -1;
-    } else {
-        digitalWrite(MMU_DIR_PIN, MMU_DIRECTION);
+        fillEffectLEDs(startupBlinkState ? ORANGE_COLOR : BLACK_COLOR);
     }
+}
 
-    if (rpm == 0) {
-        rpm = MMU_DEFAULT_RPM;
-    } else if (rpm < MMU_MIN_RPM) {
-        rpm = MMU_MIN_RPM;
+// Only used before the scheduler runs, when nothing else can happen anyway
+void blinkErrorLEDs() {
+    while (true) {
+        for (int i = 0; i < NUMBER_OF_FILAMENTS; i++) {
+            pixels.setPixelColor(FILAMENT_LEDS[i], getPaletteColor(RED_COLOR));
+        }
+        pixels.show();
+        delay(500);
+
+        pixels.clear();
+        pixels.show();
+        delay(500);
     }
+}
 
-    unsigned long totalSteps = 0;
-    unsigned long steps = getStepsFromDegrees(degrees);
-    unsigned long decelerationSteps = steps - (steps / 100UL);
+void changeMusicLED(int index) {
+    int currentColorIndex;
 
-    unsigned long targetPulsePeriod = 60000000UL / ((unsigned long)rpm * (unsigned long)MMU_MICROSTEPS * (unsigned long)MMU_MOTOR_STEPS);
-    unsigned int targetDelay = targetPulsePeriod / 2UL;
-    unsigned int currentDelay = MMU_SLOW_PULSE_DELAY;
-    unsigned long skipStepCount = 0;
-    bool acelerated = false;
-    bool lastHubState = hubState;
+    do {
+        currentColorIndex = random(0, NUMBER_OF_MUSIC_COLORS);
+    } while (currentColorIndex == lastColorIndex);
 
-    if (!accelerationEnabled) {
-        currentDelay = targetDelay;
-    }
+    lastColorIndex = currentColorIndex;
 
-    for (unsigned long i = 0; i < steps; i++) {
-        if (skipStepCount > MMU_ACCEL_DECEL_SKIP_STEPS) {
-            if (decelerationEnabled && currentDelay != MMU_SLOW_PULSE_DELAY && i > decelerationSteps) {
-                skipStepCount = 0;
-                currentDelay += 1;
+    melodyLED = index;
+    melodyLEDColor = MUSIC_COLORS[currentColorIndex];
+}
 
-                if (currentDelay > MMU_SLOW_PULSE_DELAY) {
-                    currentDelay = MMU_SLOW_PULSE_DELAY;
-                }
+void buttonClickSound() {
+    if (currentMelody < 0) {
+        tone(BUZZER_PIN, NOTE_C6, 50);
+    }
+}
 
-            } else if (accelerationEnabled && !acelerated && currentDelay != targetDelay) {
-                skipStepCount = 0;
-                currentDelay -= 1;
+uint8_t getMelodyPriority(int melody) {
+    return pgm_read_byte(&MELODIES[melody].priority);
+}
 
-                if (currentDelay < targetDelay) {
-                    currentDelay = targetDelay;
-                    acelerated = true;
-                }
-            }
-        }
+void startMIDI(const MelodyRequest& request) {
+    currentMelody = request.melody;
+    melodyLedEnabled = request.ledEnabled;
+    melodyLED = -1;
+    melodyIndex = 0;
+    melodyDeadline = millis();
+}
+
+void finishMIDI() {
+    noTone(BUZZER_PIN);
 
-        skipStepCount++;
-        totalSteps++;
+    currentMelody = -1;
+}
 
-        if (hubState != lastHubState && resetOnSensor) {
-            logInfo(F("Resetting on filament sensor"), "");
+// Queued behind anything of the same or higher priority, when full the lowest priority one is dropped
+void queueMIDI(const MelodyRequest& request) {
+    uint8_t priority = getMelodyPriority(request.melody);
 
-            i = 0;
-            skipStepCount = 0;
-            currentDelay = targetDelay;
-            lastHubState = hubState;
+    if (melodyQueueLength == MELODY_QUEUE_SIZE) {
+        if (getMelodyPriority(melodyQueue[MELODY_QUEUE_SIZE - 1].melody) >= priority) {
+            return;
         }
 
-        digitalWrite(MMU_STEP_PIN, HIGH);
-        delayMicroseconds(currentDelay);
-        digitalWrite(MMU_STEP_PIN, LOW);
-        delayMicroseconds(currentDelay);
+        melodyQueueLength--;
     }
 
-    digitalWrite(MMU_ENABLE_PIN, HIGH);
-
-    return totalSteps;
-}
+    int position = melodyQueueLength;
 
-void rotateMmuToSensor(int targetState, long milimeters, long milimetersToStuck, int direction, int rpm) {
-    if (milimeters == 0) {
-        return;
+    while (position > 0 && getMelodyPriority(melodyQueue[position - 1].melody) < priority) {
+        melodyQueue[position] = melodyQueue[position - 1];
+        position--;
     }
 
-    if (hubState == targetState) {
-        hubStateStucked = true;
-        changeLED(activeFilament, ORANGE_COLOR);
-        logWarn("Hub sensor stucked or missing", (""));
-    }
+    melodyQueue[position] = request;
+    melodyQueueLength++;
+}
 
-    digitalWrite(MMU_ENABLE_PIN, LOW);
-    digitalWrite(MMU_DIR_PIN, direction);
+void playMIDI(int melody, bool ledEnabled) {
+    MelodyRequest request = {(uint8_t)melody, ledEnabled};
 
-    if (rpm == 0) {
-        rpm = MMU_DEFAULT_RPM;
-    } else if (rpm < MMU_MIN_RPM) {
-        rpm = MMU_MIN_RPM;
-    }
+    if (currentMelody < 0) {
+        startMIDI(request);
 
-    unsigned long stepsToStuck = getStepsFromMilimeters(milimetersToStuck);
+    } else if (getMelodyPriority(melody) > getMelodyPriority(currentMelody)) {
+        finishMIDI();
+        startMIDI(request);
 
-    if (direction != MMU_DIRECTION) {
-        milimeters *= -1;  // retract
+    } else {
+        queueMIDI(request);
     }
+}
 
-    unsigned long targetPulsePeriod = 60000000UL / ((unsigned long)rpm * (unsigned long)MMU_MICROSTEPS * (unsigned long)MMU_MOTOR_STEPS);
-    unsigned int targetDelay = targetPulsePeriod / 2UL;
-    unsigned int currentDelay = MMU_SLOW_PULSE_DELAY;
-    unsigned long skipStepCount = 0;
-    unsigned long checkIntervalCount = 0;
-    unsigned long steps = 0;
+void updateMIDI() {
+    if (currentMelody < 0) {
+        if (melodyQueueLength == 0) {
+            return;
+        }
 
-    while (hubState != targetState || hubStateStucked) {
-        if (skipStepCount > MMU_ACCEL_DECEL_SKIP_STEPS && currentDelay != targetDelay) {
-            skipStepCount = 0;
-            currentDelay -= 1;
+        startMIDI(melodyQueue[0]);
 
-            if (currentDelay < targetDelay) {
-                currentDelay = targetDelay;
-            }
+        melodyQueueLength--;
+        for (int i = 0; i < melodyQueueLength; i++) {
+            melodyQueue[i] = melodyQueue[i + 1];
         }
+    }
 
-        if (direction != MMU_DIRECTION && steps > stepsToStuck) {
-            hubStateStucked = true;
+    if ((long)(millis() - melodyDeadline) < 0) {
+        return;
+    }
 
-            changeLED(activeFilament, ORANGE_COLOR);
+    melodyLED = -1;
 
-            logWarn("Hub sensor stucked or missing on retract", (""));
-            break;
+    if (melodyIndex >= pgm_read_byte(&MELODIES[currentMelody].length)) {
+        finishMIDI();
+        return;
+    }
 
-        } else if (direction == MMU_DIRECTION && steps > stepsToStuck && !autoExtruding) {
-            hubStateStucked = true;
+    const MelodyNote* notes = (const MelodyNote*)pgm_read_ptr(&MELODIES[currentMelody].notes);
+    MelodyNote melodyNote;
+    memcpy_P(&melodyNote, &notes[melodyIndex], sizeof(MelodyNote));
 
-            changeLED(activeFilament, ORANGE_COLOR);
+    int filamentLED;
 
-            logWarn("Hub sensor stucked or missing on extrude", (""));
-            break;
+    do {
+        filamentLED = random(0, NUMBER_OF_FILAMENTS - 1);
+    } while (filamentLED == lastFilamentLED);
+
+    lastFilamentLED = filamentLED;
+
+    if (melodyNote.note == 0) {
+        noTone(BUZZER_PIN);
+    } else {
+        tone(BUZZER_PIN, melodyNote.note, melodyNote.duration);
+
+        if (melodyLedEnabled) {
+            changeMusicLED(filamentLED);
+        }
+    }
+
+    melodyIndex++;
+    melodyDeadline += melodyNote.duration * 13UL / 10UL;
+}
+
+bool isPlayingMIDI() {
+    return currentMelody > -1 || melodyQueueLength > 0;
+}
+
+void waitForMIDI() {
+    while (isPlayingMIDI()) {
+        runTasks();
+    }
+}
+
+bool playMIDI(int position) {
+    if (position < 0 || position >= NUMBER_OF_MELODIES) {
+        logError(LOG_UNKNOWN_MIDI, position);
+        return false;
+    }
+
+    playMIDI(position, true);
+    return true;
+}
+
+void setMissingFilament() {
+    logInfo(LOG_MISSING_FILAMENT);
+    mcp.digitalWrite(CREALITY_FILAMENT_SENSOR_PIN, HIGH);
+}
+
+void unsetMissingFilament() {
+    mcp.digitalWrite(CREALITY_FILAMENT_SENSOR_PIN, LOW);
+}
+
+struct StepperMove {
+    unsigned long stepsToHub;  // limit while searching for the hub sensor, 0 to skip the search
+    unsigned long steps;       // steps to run after the search
+    unsigned int interval;     // cruise timer ticks between steps
+    bool direction;
+    bool accelerate;
+    bool decelerate;
+    bool hubTarget;
+    bool restartOnHub;  // count steps again on every hub sensor change after the search
+};
+
+enum StepperRampState {
+    RAMP_ACCELERATING,
+    RAMP_CRUISING,
+    RAMP_DECELERATING
+};
+
+StepperMove stepperMove;
+volatile unsigned long stepperStepsLeft = 0;
+volatile unsigned long stepperStepsDone = 0;
+volatile unsigned int stepperInterval = 0;
+volatile bool stepperRunning = false;
+volatile bool stepperSearchingHub = false;
+volatile bool stepperHubReached = false;
+volatile bool stepperHubRestarted = false;
+
+unsigned int stepperRampIntervals[MMU_RAMP_TABLE_SIZE];
+unsigned int stepperRampSegmentSteps;
+unsigned long stepperRampLength;
+volatile StepperRampState stepperRampState;
+volatile uint8_t stepperRampIndex;
+volatile unsigned int stepperRampSegmentLeft;
+volatile unsigned long stepperRampSteps;  // steps needed to slow down from the current speed
+
+// Hub sensor edges latched by the interrupt. Single producer (ISR) and single consumer
+// (processHubEvents), each side only writes its own index so no locking is needed.
+struct HubEvent {
+    unsigned long timestamp;  // micros()
+    unsigned long steps;      // stepperStepsDone at the edge
+    bool level;
+};
+
+HubEvent hubEvents[HUB_EVENT_QUEUE_SIZE];
+volatile uint8_t hubEventHead = 0;
+volatile uint8_t hubEventTail = 0;
+volatile uint8_t hubEventsDropped = 0;
+unsigned long hubCrossingSteps = STEPPER_STEPS_UNLIMITED;  // first edge onto the hub target of the last search
+
+FORCE_INLINE unsigned int getNextStepperCompare(unsigned int compare) {
+    if (compare >= SERVO_FRAME_TICKS) {
+        compare -= SERVO_FRAME_TICKS;
+    }
+
+    return compare;
+}
+
+FORCE_INLINE void stopStepperMove() {
+    TIMSK1 &= ~_BV(OCIE1B);
+    stepperRunning = false;
+}
+
+FORCE_INLINE void startStepperLeg() {
+    stepperSearchingHub = false;
+    stepperStepsLeft = stepperMove.steps;
+
+    if (stepperStepsLeft == 0) {
+        stopStepperMove();
+    }
+}
+
+FORCE_INLINE void updateStepperRamp() {
+    switch (stepperRampState) {
+        case RAMP_ACCELERATING:
+            stepperRampSteps++;
+
+            if (--stepperRampSegmentLeft == 0) {
+                stepperRampSegmentLeft = stepperRampSegmentSteps;
+
+                if (++stepperRampIndex >= MMU_RAMP_TABLE_SIZE) {
+                    stepperRampState = RAMP_CRUISING;
+                    stepperRampIndex = MMU_RAMP_TABLE_SIZE - 1;
+                    stepperInterval = stepperMove.interval;
+                } else {
+                    stepperInterval = stepperRampIntervals[stepperRampIndex];
+                }
+            }
+            // fall through
+
+        case RAMP_CRUISING:
+            if (stepperMove.decelerate && !stepperSearchingHub && stepperStepsLeft <= stepperRampSteps) {
+                if (stepperRampState == RAMP_ACCELERATING) {
+                    stepperRampSegmentLeft = stepperRampSegmentSteps - stepperRampSegmentLeft + 1;
+                }
+
+                stepperRampState = RAMP_DECELERATING;
+            }
+            break;
+
+        case RAMP_DECELERATING:
+            if (--stepperRampSegmentLeft == 0) {
+                stepperRampSegmentLeft = stepperRampSegmentSteps;
+
+                if (stepperRampIndex > 0) {
+                    stepperRampIndex--;
+                }
+
+                stepperInterval = stepperRampIntervals[stepperRampIndex];
+            }
+            break;
+    }
+}
+
+// Timer1 is shared with the Servo library, which owns compare A and restarts the counter every
+// refresh frame, so steps are scheduled on compare B relative to the previous one.
+// Everything called from here is force inlined, a real call would make the prologue save all
+// call clobbered registers. The counter updates keep STEP high for about 1 µs.
+ISR(TIMER1_COMPB_vect) {
+    BENCH_BEGIN(BENCH_STEPPER_ISR);
+    Board::StepPin::high();
+    stepperStepsDone++;
+    stepperStepsLeft--;
+    Board::StepPin::low();
+
+    if (stepperStepsLeft == 0) {
+        if (stepperSearchingHub) {
+            startStepperLeg();  // hub sensor never switched, run the rest anyway
+        } else {
+            stopStepperMove();
+        }
+
+        if (!stepperRunning) {
+            BENCH_END(BENCH_STEPPER_ISR);
+            return;
+        }
+    }
+
+    updateStepperRamp();
+
+    unsigned int now = TCNT1;
+    unsigned int late = now >= OCR1B ? now - OCR1B : now + SERVO_FRAME_TICKS - OCR1B;
+    unsigned int next = OCR1B + stepperInterval;
+
+    if (late > stepperMaxLateTicks) {
+        stepperMaxLateTicks = late;
+    }
+
+    // held off by another interrupt, catch up instead of waiting a whole timer frame
+    if ((int)(next - now) < STEPPER_MIN_LEAD_TICKS) {
+        next = now + STEPPER_MIN_LEAD_TICKS;
+        stepperCatchUps++;
+    }
+
+    OCR1B = getNextStepperCompare(next);
+    BENCH_END(BENCH_STEPPER_ISR);
+}
+
+void setupStepper() {
+    Board::EnablePin::high();
+    Board::DirPin::output();
+    Board::StepPin::output();
+    Board::EnablePin::output();
+}
+
+unsigned int getStepperInterval(unsigned int pulseDelay) {
+    return pulseDelay * 2U * STEPPER_TICKS_PER_MICROSECOND;
+}
+
+unsigned long getStepperStepsDone() {
+    noInterrupts();
+    unsigned long steps = stepperStepsDone;
+    interrupts();
+
+    return steps;
+}
+
+// Scales the profile table to the move's cruise interval once, so the step interrupt only indexes
+// into stepperRampIntervals. The ramp length follows from v² = 2 a x. The S-curve peaks at 1.5
+// times its average acceleration, so holding that peak to the same limit makes the ramp 1.5 times longer.
+void planStepperRamp(unsigned int interval) {
+    const uint16_t* factors = MMU_S_CURVE_PROFILE ? S_CURVE_RAMP_FACTORS : TRAPEZOIDAL_RAMP_FACTORS;
+    unsigned int startInterval = getStepperInterval(MMU_SLOW_PULSE_DELAY);
+
+    for (int i = 0; i < MMU_RAMP_TABLE_SIZE; i++) {
+        unsigned long rampInterval = ((unsigned long)interval * pgm_read_word(&factors[i])) >> 8;
+
+        if (rampInterval > startInterval) {
+            rampInterval = startInterval;
+        }
+        if (rampInterval < interval) {
+            rampInterval = interval;
+        }
+
+        stepperRampIntervals[i] = rampInterval;
+    }
+
+    float stepRate = 1000000.0 * STEPPER_TICKS_PER_MICROSECOND / interval;
+    float acceleration = milimetersAcceleration * (stepsPerMilimeter / 65536.0);
+    float rampLength = stepRate * stepRate / (2.0 * acceleration);
+
+    if (MMU_S_CURVE_PROFILE) {
+        rampLength *= 1.5;
+    }
+
+    unsigned long segmentSteps = rampLength / MMU_RAMP_TABLE_SIZE;
+    stepperRampSegmentSteps = constrain(segmentSteps, 1UL, 0xFFFFUL);
+    stepperRampLength = (unsigned long)stepperRampSegmentSteps * MMU_RAMP_TABLE_SIZE;
+}
+
+// Exact to the microstep, split in two so the products stay within 32 bits
+long getMicrometersFromSteps(unsigned long steps) {
+    return ((steps >> 8) * micrometersPerStep >> 8) + ((steps & 0xFF) * micrometersPerStep >> 16);
+}
+
+// DONE <id> <OK or ERROR> steps=<n> mm=<distance>, the end of an accepted motion command. The log
+// records go out right before it, the daemon doesn't poll while an operation runs.
+void reportOperation(uint8_t operation, bool succeeded, unsigned long steps) {
+    long micrometers = getMicrometersFromSteps(steps);
+    int fraction = micrometers % 1000;
+
+    dumpLogs();
+
+    serialLink.beginMessage(FRAME_EVENT, 0);
+    serialLink.print(F("DONE "));
+    serialLink.print(operation);
+    serialLink.print(succeeded ? F(" OK") : F(" ERROR"));
+    serialLink.print(F(" steps="));
+    serialLink.print(steps);
+    serialLink.print(F(" mm="));
+    serialLink.print(micrometers / 1000);
+    serialLink.print(fraction < 100 ? (fraction < 10 ? F(".00") : F(".0")) : F("."));
+    serialLink.print(fraction);
+    serialLink.endMessage();
+}
+
+void completeOperation(uint8_t operation, bool succeeded, unsigned long steps) {
+    if (!succeeded) {
+        commandFailed = true;
+    }
+
+    reportOperation(operation, succeeded, steps);
+}
+
+// Drains the hub edge queue, remembering where the running search first reached its target
+void processHubEvents() {
+    while (hubEventTail != hubEventHead) {
+        const HubEvent& event = hubEvents[hubEventTail];
+
+        if (stepperMove.stepsToHub > 0 && hubCrossingSteps == STEPPER_STEPS_UNLIMITED &&
+            event.level == stepperMove.hubTarget) {
+            hubCrossingSteps = event.steps;
+        }
+
+        logDebug(LOG_HUB_STATE_CHANGED, event.level, event.steps);
+
+        hubEventTail = (hubEventTail + 1) & (HUB_EVENT_QUEUE_SIZE - 1);
+    }
+
+    if (hubEventsDropped > 0) {
+        logWarn(LOG_HUB_EVENTS_DROPPED, hubEventsDropped);
+        hubEventsDropped = 0;
+    }
+}
+
+void startStepperMove(const StepperMove& move) {
+    if (move.stepsToHub == 0 && move.steps == 0) {
+        return;
+    }
+
+    Board::EnablePin::low();
+    Board::DirPin::write(move.direction);
+
+    processHubEvents();  // edges from before this move
+    hubCrossingSteps = STEPPER_STEPS_UNLIMITED;
+
+    noInterrupts();
+    stepperMove = move;
+    stepperStepsDone = 0;
+    stepperHubReached = false;
+    stepperHubRestarted = false;
+    stepperSearchingHub = move.stepsToHub > 0;
+    stepperStepsLeft = stepperSearchingHub ? move.stepsToHub : move.steps;
+
+    stepperRampSegmentLeft = stepperRampSegmentSteps;
+
+    if (move.accelerate) {
+        stepperRampState = RAMP_ACCELERATING;
+        stepperRampIndex = 0;
+        stepperRampSteps = 0;
+        stepperInterval = stepperRampIntervals[0];
+    } else {
+        stepperRampState = RAMP_CRUISING;
+        stepperRampIndex = MMU_RAMP_TABLE_SIZE - 1;
+        stepperRampSteps = stepperRampLength;
+        stepperInterval = move.interval;
+    }
+
+    stepperRunning = true;
+
+    OCR1B = getNextStepperCompare(TCNT1 + stepperInterval);
+    TIFR1 = _BV(OCF1B);
+    TIMSK1 |= _BV(OCIE1B);
+    interrupts();
+}
+
+void pushHubEvent() {
+    uint8_t next = (hubEventHead + 1) & (HUB_EVENT_QUEUE_SIZE - 1);
+
+    if (next == hubEventTail) {
+        hubEventsDropped++;
+        return;
+    }
+
+    HubEvent& event = hubEvents[hubEventHead];
+    event.timestamp = micros();
+    event.steps = stepperStepsDone;
+    event.level = hubState;
+
+    hubEventHead = next;
+}
+
+void changeHubState() {
+    // Read raw pin state directly
+    hubState = Board::HubSensorPin::read();
+    hubInterruptCount++;
+    pushHubEvent();
+    hubStateStucked = false;
+
+    if (!stepperRunning) {
+        return;
+    }
+
+    if (stepperSearchingHub) {
+        if (hubState == stepperMove.hubTarget) {
+            stepperHubReached = true;
+            startStepperLeg();
+        }
+
+    } else if (stepperMove.restartOnHub) {
+        stepperHubRestarted = true;
+        stepperStepsLeft = stepperMove.steps;
+
+        if (stepperRampState == RAMP_DECELERATING) {
+            stepperRampState = RAMP_ACCELERATING;
+            stepperRampSteps = (unsigned long)stepperRampIndex * stepperRampSegmentSteps;
+        }
+    }
+}
+
+// Re-reads the hub sensor from the main loop. The ISR is the only producer of the hub event queue
+// and of the edge count, so this just takes the level, with the ISR held off while it's written.
+void refreshHubState() {
+    noInterrupts();
+    hubState = Board::HubSensorPin::read();
+    hubStateStucked = false;
+    interrupts();
+}
+
+void updateDistanceScale() {
+    uint64_t stepsPerRotation = (uint64_t)MMU_MICROSTEPS * MMU_MOTOR_STEPS;
+
+    stepsPerMilimeter = ((stepsPerRotation * 1000000ULL << 16) + nanometersPerRotation / 2) / nanometersPerRotation;
+    micrometersPerStep = (((uint64_t)nanometersPerRotation << 16) / 1000 + stepsPerRotation / 2) / stepsPerRotation;
+}
+
+long getStepsFromDegrees(long degrees) {
+    return degrees * (unsigned long)MMU_MICROSTEPS * (unsigned long)MMU_MOTOR_STEPS / 360UL;
+}
+
+long getStepsFromMilimeters(long milimeters) {
+    long fraction = milimeters * (long)(stepsPerMilimeter & 0xFFFF);
+    return milimeters * (long)(stepsPerMilimeter >> 16) + ((fraction + 0x8000) >> 16);
+}
+
+// Like getStepsFromMilimeters, but carries the rounding over to the next move so repeated moves
+// don't drift
+long takeStepsFromMilimeters(long milimeters, bool extruding) {
+    long fraction = milimeters * (long)(stepsPerMilimeter & 0xFFFF) + (extruding ? stepperResidual : -stepperResidual);
+    long fractionSteps = (fraction + 0x8000) >> 16;
+    long remainder = fraction - fractionSteps * 0x10000L;
+
+    stepperResidual = extruding ? remainder : -remainder;
+    return milimeters * (long)(stepsPerMilimeter >> 16) + fractionSteps;
+}
+
+unsigned long getServoTravelTime(int from, int to) {
+    int distance = from < 0 ? SERVO_MAX_ANGLE : abs(to - from);
+    return (unsigned long)distance * 1000UL / servoDegreesPerSecond;
+}
+
+// Without slewing the servo gets the target right away and is detached once it had time to travel
+// there. Slewed moves walk the commanded angle over at servoDegreesPerSecond instead.
+void startServoMove(ServoMotion& motion, int position, bool slewed) {
+    if (!motion.moving) {
+        motion.servo->attach(motion.pin);
+    }
+
+    motion.startPosition = motion.position;
+    motion.target = position;
+    motion.startMillis = millis();
+    motion.moving = true;
+    motion.slewing = slewed && motion.position >= 0 && motion.position != position;
+
+    // an ASYNC move taken over before it settled never reaches its target
+    if (motion.operation != 0) {
+        reportOperation(motion.operation, false, 0);
+        motion.operation = 0;
+    }
+
+    if (motion.slewing) {
+        motion.servo->write(motion.position);
+    } else {
+        motion.servo->write(position);
+        motion.position = position;
+        motion.deadline = motion.startMillis + getServoTravelTime(motion.startPosition, position) + SERVO_SETTLE_MARGIN;
+    }
+}
+
+void updateServoMove(ServoMotion& motion) {
+    if (!motion.moving) {
+        return;
+    }
+
+    unsigned long currentMillis = millis();
+
+    if (motion.slewing) {
+        int distance = motion.target - motion.startPosition;
+        long travelled = (long)(currentMillis - motion.startMillis) * servoDegreesPerSecond / 1000L;
+
+        if (travelled >= abs(distance)) {
+            motion.position = motion.target;
+            motion.slewing = false;
+            motion.deadline = currentMillis + SERVO_SETTLE_MARGIN;
+        } else {
+            motion.position = motion.startPosition + (distance > 0 ? travelled : -travelled);
+        }
+
+        motion.servo->write(motion.position);
+        return;
+    }
+
+    if ((long)(currentMillis - motion.deadline) >= 0) {
+        motion.servo->detach();
+        motion.moving = false;
+
+        if (motion.operation != 0) {
+            reportOperation(motion.operation, true, 0);
+            motion.operation = 0;
+        }
+    }
+}
+
+void waitForServoMove(ServoMotion& motion) {
+    while (motion.moving) {
+        runTasks();
+    }
+}
+
+void startCutterServoMove(int position) {
+    startServoMove(cutterServoMotion, position, false);
+}
+
+void startMMUServoMove(int position) {
+    lastMMUPosition = position;
+
+    startServoMove(mmuServoMotion, position, servoSlewEnabled);
+}
+
+void setCutterServoPosition(int position) {
+    startCutterServoMove(position);
+    waitForServoMove(cutterServoMotion);
+}
+
+void setMMUServoPosition(int position) {
+    startMMUServoMove(position);
+    waitForServoMove(mmuServoMotion);
+}
+
+void testLED(int index) {
+    logInfo(LOG_TESTING_LED, index + 1);
+
+    ledTestIndex = index;
+    ledTestColorIndex = 0;
+    blinkLED(index, TEST_LED_COLORS[0]);
+}
+
+void updateLEDTest() {
+    if (ledTestIndex < 0 || isBlinkingLED(ledTestIndex)) {
+        return;
+    }
+
+    ledTestColorIndex++;
+
+    if (ledTestColorIndex < NUMBER_OF_TEST_LED_COLORS) {
+        blinkLED(ledTestIndex, TEST_LED_COLORS[ledTestColorIndex]);
+
+    } else if (ledTestIndex < ledTestLastIndex) {
+        testLED(ledTestIndex + 1);
+
+    } else {
+        ledTestIndex = -1;
+    }
+}
+
+void runLEDTest(int firstIndex, int lastIndex) {
+    ledTestLastIndex = lastIndex;
+    testLED(firstIndex);
+
+    while (ledTestIndex > -1) {
+        runTasks();
+    }
+}
+
+void safeTestLED(int index) {
+    logInfo(LOG_TESTING_LEDS);
+
+    runLEDTest(index, index);
+}
+
+void testLEDs() {
+    logInfo(LOG_TESTING_LEDS);
+
+    runLEDTest(0, NUMBER_OF_FILAMENTS - 1);
+}
+
+// Moves the selector onto the slot whether it has filament or not
+void selectFilament(int index) {
+    activeFilament = index;
+    selectingFilament = index;
+
+    setMMUServoPosition(filamentPositions[activeFilament]);
+    selectingFilament = -1;
+}
+
+bool setFilament(int index) {
+    if (index < 0 || index >= NUMBER_OF_FILAMENTS) {
+        return false;
+    }
+
+    bool filamentState = filamentStates[index];
+    selectFilament(index);
+
+    if (filamentState == LOW) {
+        unsetMissingFilament();
+
+    } else {
+        playMIDI(ERROR_MIDI, false);
+        blinkLED(activeFilament, RED_COLOR);
+        return false;
+    }
+
+    return true;
+}
+
+void filamentRelease() {
+    if (lastMMUPosition > 90) {
+        selectingFilament = 7;
+        setMMUServoPosition(filamentPositions[7]);
+
+    } else {
+        selectingFilament = 0;
+        setMMUServoPosition(filamentPositions[0]);
+    }
+
+    selectingFilament = -1;
+}
+
+bool swapFinish() {
+    if (activeFilament < 0 || hubStateStucked || filamentStates[activeFilament] == HIGH) {
+        setMissingFilament();
+        playMIDI(ERROR_MIDI, false);
+        return false;
+    }
+
+    return true;
+}
+
+// Rounded straight to timer ticks, going through whole microseconds ran 500 RPM about 17% fast
+unsigned int getStepperIntervalFromRpm(int rpm) {
+    unsigned long stepsPerMinute = (unsigned long)rpm * (unsigned long)MMU_MICROSTEPS * (unsigned long)MMU_MOTOR_STEPS;
+    return (60000000UL * STEPPER_TICKS_PER_MICROSECOND + stepsPerMinute / 2UL) / stepsPerMinute;
+}
+
+// Matches a linear speed from the Q16.16 steps per mm instead of going through whole RPM
+unsigned int getStepperIntervalFromSpeed(long milimetersPerMinute) {
+    uint64_t stepsPerMinute = (uint64_t)milimetersPerMinute * stepsPerMilimeter;
+    uint64_t interval = (((uint64_t)60000000UL * STEPPER_TICKS_PER_MICROSECOND << 16) + stepsPerMinute / 2) / stepsPerMinute;
+    unsigned int fastest = getStepperIntervalFromRpm(MMU_DEFAULT_RPM);
+
+    if (interval < fastest) {
+        return fastest;
+    } else if (interval > 0xFFFF) {
+        return 0xFFFF;
+    }
+
+    return interval;
+}
+
+int getValidRpm(int rpm) {
+    if (rpm == 0) {
+        return MMU_DEFAULT_RPM;
+    } else if (rpm < MMU_MIN_RPM) {
+        return MMU_MIN_RPM;
+    }
+
+    return rpm;
+}
+
+void checkAlive() {
+    unsigned long currentMillis = millis();
+    if (currentMillis - previousAliveMessageMillis > ALIVE_MESSAGE_INTERVAL) {
+        responseAlive();
+        previousAliveMessageMillis = currentMillis;
+    }
+}
+
+void recordStepRate(unsigned int interval, unsigned long startMicros) {
+    unsigned long elapsedMillis = (micros() - startMicros) / 1000UL;
+
+    stats.requestedStepRate = 1000000UL * STEPPER_TICKS_PER_MICROSECOND / interval;
+
+    if (elapsedMillis > 0) {
+        stats.achievedStepRate = getStepperStepsDone() * 1000UL / elapsedMillis;
+    }
+}
+
+void waitForStepperMove() {
+    while (stepperRunning) {
+        if (stepperHubRestarted) {
+            stepperHubRestarted = false;
+            logInfo(LOG_RESETTING_ON_FILAMENT_SENSOR);
+        }
+
+        runTasks();
+    }
+}
+
+unsigned long rotateMmu(long degrees, int rpm, bool accelerationEnabled, bool decelerationEnabled, bool resetOnSensor) {
+    if (degrees == 0) {
+        return 0;
+    }
+
+    bool direction = MMU_DIRECTION;
+
+    if (degrees < 0) {
+        direction = !MMU_DIRECTION;
+        degrees *= -1;
+    }
+
+    rpm = getValidRpm(rpm);
+    waitForServoMove(mmuServoMotion);
+
+    unsigned long steps = getStepsFromDegrees(degrees);
+    unsigned int interval = getStepperIntervalFromRpm(rpm);
+
+    planStepperRamp(interval);
+
+    StepperMove move = {0, steps, interval, direction, accelerationEnabled, decelerationEnabled, LOW, resetOnSensor};
+    unsigned long startMicros = micros();
+    startStepperMove(move);
+    waitForStepperMove();
+    recordStepRate(interval, startMicros);
+
+    Board::EnablePin::high();
+
+    return getStepperStepsDone();
+}
+
+// Searches for the hub sensor edge and runs the given distance past it as one move, accelerating
+// once at the start and slowing down only at the very end. Returns the steps done.
+unsigned long rotateMmuToSensor(int targetState, long milimeters, long milimetersToStuck, int direction, int rpm) {
+    if (milimeters == 0) {
+        return 0;
+    }
+
+    if (hubState == targetState) {
+        hubStateStucked = true;
+        logWarn(LOG_HUB_SENSOR_STUCK);
+    }
+
+    rpm = getValidRpm(rpm);
+    waitForServoMove(mmuServoMotion);
+
+    unsigned long stepsToStuck = getStepsFromMilimeters(milimetersToStuck) + 1UL;
+
+    if (direction == MMU_DIRECTION && autoExtruding) {
+        stepsToStuck = STEPPER_STEPS_UNLIMITED;
+    }
+
+    unsigned long steps = takeStepsFromMilimeters(milimeters, direction == MMU_DIRECTION);
+    unsigned int interval = getStepperIntervalFromRpm(rpm);
+    bool resetOnSensor = direction != MMU_DIRECTION;  // reset on retract
+
+    planStepperRamp(interval);
+
+    StepperMove move = {stepsToStuck, steps, interval, (bool)direction, true, true, (bool)targetState, resetOnSensor};
+    unsigned long startMicros = micros();
+    startStepperMove(move);
+
+    while (stepperSearchingHub) {
+        runTasks();
+    }
+
+    if (!stepperHubReached) {
+        hubStateStucked = true;
+
+        if (direction != MMU_DIRECTION) {
+            logWarn(LOG_HUB_SENSOR_STUCK_ON_RETRACT);
+        } else {
+            logWarn(LOG_HUB_SENSOR_STUCK_ON_EXTRUDE);
+        }
+    }
+
+    waitForStepperMove();
+    recordStepRate(interval, startMicros);
+    processHubEvents();
+
+    if (hubCrossingSteps != STEPPER_STEPS_UNLIMITED) {
+        logInfo(LOG_HUB_CROSSING, getMicrometersFromSteps(hubCrossingSteps), hubCrossingSteps);
+    }
+
+    unsigned long stepsDone = getStepperStepsDone();
+    long stepsMicrometers = getMicrometersFromSteps(stepsDone);
+
+    if (direction == MMU_DIRECTION) {
+        logInfo(LOG_EXTRUDED_MICROMETERS, stepsMicrometers);
+
+    } else if (direction != MMU_DIRECTION) {
+        logInfo(LOG_RETRACTED_MICROMETERS, stepsMicrometers);
+    }
+
+    Board::EnablePin::high();
+    return stepsDone;
+}
+
+unsigned long extrude(long milimeters, int rpm) {
+    long totalMilimetersToStuck = milimetersToStuck + retractMilimeters;
+    return rotateMmuToSensor(LOW, milimeters, totalMilimetersToStuck, MMU_DIRECTION, rpm);
+}
+
+unsigned long retract(long milimeters, int rpm) {
+    long totalMilimetersToStuck = milimetersToStuck + extrudeMilimeters;
+    return rotateMmuToSensor(HIGH, milimeters, totalMilimetersToStuck, !MMU_DIRECTION, rpm);
+}
+
+void readHubState() {
+    if (hubState != lastHubState) {
+        lastHubState = hubState;
+
+        if (activeFilament > -1 && filamentStates[activeFilament] == LOW && !hubStateStucked && hubState == LOW) {
+            unsetMissingFilament();
+        }
+    }
+}
+
+void recordSensorRead(unsigned long startMicros, uint8_t transactions) {
+    unsigned long elapsedMicros = micros() - startMicros;
+
+    stats.sensorReads++;
+    stats.i2cTransactions += transactions;
+    stats.i2cTotalMicros += elapsedMicros;
+
+    if (elapsedMicros > stats.i2cMaxMicros) {
+        stats.i2cMaxMicros = elapsedMicros;
+    }
+}
+
+// Both banks in one bus transaction, which also clears INTA
+void scanInputs() {
+    unsigned long startMicros = micros();
+    BENCH_BEGIN(BENCH_INPUT_SCAN);
+    uint16_t inputs = mcp.readGPIOAB();
+    BENCH_END(BENCH_INPUT_SCAN);
+    recordSensorRead(startMicros, 1);
+
+    uint16_t scanMillis = millis();
+    uint16_t changed = (inputs ^ rawInputs) & monitoredInputs;
+
+    for (uint8_t pin = 0; pin < 16; pin++) {
+        if (changed & (1U << pin)) {
+            inputChangeMillis[pin] = scanMillis;
+        }
+    }
+
+    rawInputs = inputs;
+}
+
+unsigned long lastInputScanMillis = 0;
+
+// With INTA wired the bus stays idle until it reports a change, the expander holds it low until the
+// read, so an edge can't be missed between two passes. Otherwise both banks are polled. Debouncing
+// runs on the last snapshot either way.
+void updateInputs() {
+    if (Board::MCP_INTERRUPT_WIRED) {
+        if (Board::McpInterruptPin::read() == LOW) {
+            scanInputs();
+        }
+    } else if (millis() - lastInputScanMillis >= INPUT_POLL_INTERVAL) {
+        lastInputScanMillis = millis();
+        scanInputs();
+    }
+
+    uint16_t pending = (rawInputs ^ stableInputs) & monitoredInputs;
+
+    if (pending == 0) {
+        return;
+    }
+
+    uint16_t currentMillis = millis();
+
+    for (uint8_t pin = 0; pin < 16; pin++) {
+        uint16_t mask = 1U << pin;
+
+        if ((pending & mask) && (uint16_t)(currentMillis - inputChangeMillis[pin]) >= INPUT_DEBOUNCE_TIME) {
+            stableInputs ^= mask;
+        }
+    }
+}
+
+bool readInput(uint8_t pin) {
+    return (stableInputs & (1U << pin)) != 0;
+}
+
+void setupInputs() {
+    monitoredInputs = 1U << ACTION_BUTTON_PIN;
+
+    for (int i = 0; i < NUMBER_OF_FILAMENTS; i++) {
+        monitoredInputs |= 1U << FILAMENT_SENSOR_PINS[i];
+    }
+
+    if (Board::MCP_INTERRUPT_WIRED) {
+        // INTA mirrors both banks, active low, compared against the previous value
+        mcp.setupInterrupts(true, false, LOW);
+
+        for (uint8_t pin = 0; pin < 16; pin++) {
+            if (monitoredInputs & (1U << pin)) {
+                mcp.setupInterruptPin(pin, CHANGE);
+            }
+        }
+
+        Board::McpInterruptPin::inputPullup();
+    }
+
+    scanInputs();
+    stableInputs = rawInputs;
+}
+
+void readSensors(bool soundEnabled) {
+    for (int i = 0; i < NUMBER_OF_FILAMENTS; i++) {
+        bool state = readInput(FILAMENT_SENSOR_PINS[i]);
+        if (state != filamentStates[i]) {
+            filamentStates[i] = state;
+
+            if (state == LOW) {
+                logInfo(LOG_FILAMENT_INSERTED, i);
+
+                if (i == activeFilament) {
+                    unsetMissingFilament();
+                }
+
+                if (soundEnabled) {
+                    playMIDI(FILAMENT_INSERTED_MIDI, false);
+                }
+
+            } else {
+                logInfo(LOG_FILAMENT_REMOVED, i);
+
+                if (i == activeFilament) {
+                    setMissingFilament();
+
+                    if (soundEnabled) {
+                        playMIDI(ERROR_MIDI, false);
+                    }
+
+                    blinkLED(i, RED_COLOR);
+
+                } else if (soundEnabled) {
+                    playMIDI(FILAMENT_REMOVED_MIDI, false);
+                }
+            }
+        }
+    }
+}
+
+unsigned long actionButtonPressedTime = 0;
+
+// The sensor task only records a press, loop() runs it so the tasks keep running during the move
+enum ActionButtonPress : uint8_t { ACTION_BUTTON_NONE, ACTION_BUTTON_SHORT, ACTION_BUTTON_LONG };
+ActionButtonPress actionButtonPress = ACTION_BUTTON_NONE;
+
+// A command or move still running further up the stack owns the servos and the stepper
+bool isMotionActive() {
+    return commandRunning || stepperRunning || mmuServoMotion.moving || cutterServoMotion.moving;
+}
+
+void readActionButtonPressed() {
+    bool state = readInput(ACTION_BUTTON_PIN);
+
+    if (state == LOW && actionButtonPressedTime == 0) {
+        actionButtonPressedTime = millis();
+    }
+
+    if (state == HIGH && actionButtonPressedTime > 0) {
+        unsigned long buttonPressedDuration = millis() - actionButtonPressedTime;
+        actionButtonPressedTime = 0;
+
+        buttonClickSound();
+
+        if (isMotionActive() || actionButtonPress != ACTION_BUTTON_NONE) {
+            logWarn(LOG_ACTION_BUTTON_IGNORED, buttonPressedDuration);
+            return;
+        }
+
+        actionButtonPress = buttonPressedDuration > 1000 ? ACTION_BUTTON_LONG : ACTION_BUTTON_SHORT;
+    }
+}
+
+void runActionButton() {
+    ActionButtonPress press = actionButtonPress;
+
+    if (press == ACTION_BUTTON_NONE) {
+        return;
+    }
+
+    commandRunning = true;
+
+    if (press == ACTION_BUTTON_LONG) {
+        logInfo(LOG_ACTION_BUTTON_LONG);
+
+        if (activeFilament > -1 && filamentStates[activeFilament] == LOW && hubState == HIGH) {
+            autoExtruding = true;
+            int mmuPosition = filamentPositions[activeFilament];
+
+            selectingFilament = activeFilament;
+            setMMUServoPosition(mmuPosition);
+            selectingFilament = -1;
+            extrude(extrudeMilimeters, MMU_DEFAULT_RPM);
+            filamentRelease();
+            autoExtruding = false;
+        }
+    } else {
+        logInfo(LOG_ACTION_BUTTON_SHORT);
+        filamentRelease();
+    }
+
+    commandRunning = false;
+    actionButtonPress = ACTION_BUTTON_NONE;
+}
+
+enum CommandId : uint8_t {
+    COMMAND_START,
+    COMMAND_SYNC,
+    COMMAND_FILAMENT_RELEASE,
+    COMMAND_FILAMENT,
+    COMMAND_EXTRUDE,
+    COMMAND_RETRACT,
+    COMMAND_SWAP_FINISH,
+    COMMAND_CUTTER_POSITION,
+    COMMAND_MMU_POSITION,
+    COMMAND_MMU_ROTATE,
+    COMMAND_MIDI,
+    COMMAND_TEST_LEDS,
+    COMMAND_TEST_LED,
+    COMMAND_BINARY,
+    COMMAND_LOG_DUMP,
+    COMMAND_LOG_LEVEL,
+    COMMAND_STATS,
+    COMMAND_STATS_RESET,
+    COMMAND_CALIBRATE,
+    COMMAND_SWAP,
+    COMMAND_FEED,
+    COMMAND_COUNT,
+    COMMAND_UNKNOWN = 0xFF
+};
+
+const char START_KEYWORD[] PROGMEM = "START";
+const char SYNC_KEYWORD[] PROGMEM = "SYNC";
+const char FILAMENT_RELEASE_KEYWORD[] PROGMEM = "FILAMENT_RELEASE";
+const char FILAMENT_KEYWORD[] PROGMEM = "FILAMENT";
+const char EXTRUDE_KEYWORD[] PROGMEM = "EXTRUDE";
+const char RETRACT_KEYWORD[] PROGMEM = "RETRACT";
+const char SWAP_FINISH_KEYWORD[] PROGMEM = "SWAP_FINISH";
+const char CUTTER_POSITION_KEYWORD[] PROGMEM = "CUTTER_POSITION";
+const char MMU_POSITION_KEYWORD[] PROGMEM = "MMU_POSITION";
+const char MMU_ROTATE_KEYWORD[] PROGMEM = "MMU_ROTATE";
+const char MIDI_KEYWORD[] PROGMEM = "MIDI";
+const char TEST_LEDS_KEYWORD[] PROGMEM = "TEST_LEDS";
+const char TEST_LED_KEYWORD[] PROGMEM = "TEST_LED";
+const char BINARY_KEYWORD[] PROGMEM = "BINARY";
+const char LOG_DUMP_KEYWORD[] PROGMEM = "LOG_DUMP";
+const char LOG_LEVEL_KEYWORD[] PROGMEM = "LOG_LEVEL";
+const char STATS_KEYWORD[] PROGMEM = "STATS";
+const char STATS_RESET_KEYWORD[] PROGMEM = "STATS_RESET";
+const char CALIBRATE_KEYWORD[] PROGMEM = "CALIBRATE";
+const char SWAP_KEYWORD[] PROGMEM = "SWAP";
+const char FEED_KEYWORD[] PROGMEM = "FEED";
+
+// indexed by CommandId
+const char* const COMMAND_KEYWORDS[COMMAND_COUNT] PROGMEM = {
+    START_KEYWORD, SYNC_KEYWORD, FILAMENT_RELEASE_KEYWORD, FILAMENT_KEYWORD, EXTRUDE_KEYWORD,
+    RETRACT_KEYWORD, SWAP_FINISH_KEYWORD, CUTTER_POSITION_KEYWORD, MMU_POSITION_KEYWORD,
+    MMU_ROTATE_KEYWORD, MIDI_KEYWORD, TEST_LEDS_KEYWORD, TEST_LED_KEYWORD, BINARY_KEYWORD,
+    LOG_DUMP_KEYWORD, LOG_LEVEL_KEYWORD, STATS_KEYWORD, STATS_RESET_KEYWORD, CALIBRATE_KEYWORD,
+    SWAP_KEYWORD, FEED_KEYWORD};
+
+struct CommandStats {
+    uint16_t count;
+    uint16_t maxMillis;
+    unsigned long totalMillis;
+};
+
+CommandStats commandStats[COMMAND_COUNT];
+
+enum SyncOptionId : uint8_t {
+    SYNC_FILAMENT_POSITIONS,
+    SYNC_EXTRUDE_MM,
+    SYNC_RETRACT_MM,
+    SYNC_MM_PER_ROTATION,
+    SYNC_MM_TO_STUCK,
+    SYNC_MM_ACCEL,
+    SYNC_SERVO_SPEED,
+    SYNC_SERVO_SLEW,
+    SYNC_OPTION_COUNT
+};
+
+const char FILAMENT_POSITIONS_KEYWORD[] PROGMEM = "FILAMENT_POSITIONS";
+const char EXTRUDE_MM_KEYWORD[] PROGMEM = "EXTRUDE_MM";
+const char RETRACT_MM_KEYWORD[] PROGMEM = "RETRACT_MM";
+const char MM_PER_ROTATION_KEYWORD[] PROGMEM = "MM_PER_ROTATION";
+const char MM_TO_STUCK_KEYWORD[] PROGMEM = "MM_TO_STUCK";
+const char MM_ACCEL_KEYWORD[] PROGMEM = "MM_ACCEL";
+const char SERVO_SPEED_KEYWORD[] PROGMEM = "SERVO_SPEED";
+const char SERVO_SLEW_KEYWORD[] PROGMEM = "SERVO_SLEW";
+
+// indexed by SyncOptionId
+const char* const SYNC_OPTION_KEYWORDS[SYNC_OPTION_COUNT] PROGMEM = {
+    FILAMENT_POSITIONS_KEYWORD, EXTRUDE_MM_KEYWORD, RETRACT_MM_KEYWORD, MM_PER_ROTATION_KEYWORD,
+    MM_TO_STUCK_KEYWORD, MM_ACCEL_KEYWORD, SERVO_SPEED_KEYWORD, SERVO_SLEW_KEYWORD};
+
+bool isArgumentSeparator(char c) {
+    return c == ' ' || c == ',';
+}
+
+void skipArgumentSeparators(const char*& cursor) {
+    while (isArgumentSeparator(*cursor)) {
+        cursor++;
+    }
+}
+
+// Consumes the next word if it is exactly the given PROGMEM keyword
+bool matchKeyword(const char*& cursor, PGM_P keyword) {
+    skipArgumentSeparators(cursor);
+
+    size_t length = strlen_P(keyword);
+
+    if (strncmp_P(cursor, keyword, length) != 0) {
+        return false;
+    }
+
+    if (cursor[length] != '\0' && !isArgumentSeparator(cursor[length])) {
+        return false;
+    }
+
+    cursor += length;
+    return true;
+}
+
+uint8_t findKeyword(const char*& cursor, const char* const* keywords, uint8_t count) {
+    for (uint8_t i = 0; i < count; i++) {
+        if (matchKeyword(cursor, (PGM_P)pgm_read_ptr(&keywords[i]))) {
+            return i;
+        }
+    }
+
+    return COMMAND_UNKNOWN;
+}
+
+void skipWord(const char*& cursor) {
+    skipArgumentSeparators(cursor);
+
+    while (*cursor != '\0' && !isArgumentSeparator(*cursor)) {
+        cursor++;
+    }
+}
+
+// Parses a decimal like 18.28571429 as value * 10^decimals, extra decimals are dropped
+bool parseFixed(const char*& cursor, long& value, uint8_t decimals) {
+    skipArgumentSeparators(cursor);
+
+    bool negative = *cursor == '-';
+    if (*cursor == '-' || *cursor == '+') {
+        cursor++;
+    }
+
+    if (!isdigit(*cursor) && !(*cursor == '.' && decimals > 0)) {
+        return false;
+    }
+
+    long result = 0;
+    while (isdigit(*cursor)) {
+        result = result * 10 + (*cursor++ - '0');
+    }
+
+    if (decimals > 0 && *cursor == '.') {
+        cursor++;
+    }
+
+    for (uint8_t i = 0; i < decimals; i++) {
+        result *= 10;
+
+        if (isdigit(*cursor)) {
+            result += *cursor++ - '0';
+        }
+    }
+
+    while (isdigit(*cursor)) {
+        cursor++;
+    }
+
+    value = negative ? -result : result;
+    return true;
+}
+
+bool parseLong(const char*& cursor, long& value) {
+    return parseFixed(cursor, value, 0);
+}
+
+bool parseInt(const char*& cursor, int& value) {
+    long parsed;
+
+    if (!parseLong(cursor, parsed)) {
+        return false;
+    }
+
+    value = parsed;
+    return true;
+}
+
+// Same hash the daemon computes, so it can tell whether a SYNC would change anything
+uint16_t getSyncHash(const char* cursor) {
+    uint16_t hash = 0xFFFF;
+
+    for (; *cursor != '\0'; cursor++) {
+        if (*cursor != ' ' && *cursor != '\t') {
+            hash = _crc16_update(hash, *cursor);
+        }
+    }
+
+    return hash;
+}
+
+uint8_t getConfigCrc(const StoredConfig& config) {
+    const uint8_t* bytes = (const uint8_t*)&config;
+    uint8_t crc = 0;
+
+    for (size_t i = 0; i < offsetof(StoredConfig, crc); i++) {
+        crc = _crc8_ccitt_update(crc, bytes[i]);
+    }
+
+    return crc;
+}
+
+int getConfigAddress(int slot) {
+    return slot * sizeof(StoredConfig);
+}
+
+void loadConfig() {
+    StoredConfig config;
+
+    for (int slot = 0; slot < CONFIG_SLOTS; slot++) {
+        EEPROM.get(getConfigAddress(slot), config);
+
+        if (config.version != CONFIG_VERSION || config.crc != getConfigCrc(config)) {
+            continue;
+        }
+
+        if (configSlot == -1 || (int8_t)(config.sequence - configSequence) > 0) {
+            configSlot = slot;
+            configSequence = config.sequence;
+        }
+    }
+
+    if (configSlot == -1) {
+        logInfo(LOG_CONFIG_DEFAULTS);
+        return;
+    }
+
+    EEPROM.get(getConfigAddress(configSlot), config);
+
+    memcpy(filamentPositions, config.filamentPositions, sizeof(filamentPositions));
+    extrudeMilimeters = config.extrudeMilimeters;
+    retractMilimeters = config.retractMilimeters;
+    milimetersToStuck = config.milimetersToStuck;
+    nanometersPerRotation = config.nanometersPerRotation;
+    milimetersAcceleration = config.milimetersAcceleration;
+    servoDegreesPerSecond = config.servoDegreesPerSecond;
+    servoSlewEnabled = config.servoSlewEnabled;
+    configHash = config.hash;
+
+    logInfo(LOG_CONFIG_LOADED, configSlot, configHash);
+}
+
+// Writes the next slot instead of overwriting the current copy, so a reset halfway through
+// still leaves the previous config to fall back on
+void saveConfig(uint16_t hash) {
+    if (hash == configHash) {
+        return;
+    }
+
+    StoredConfig config;
+    config.version = CONFIG_VERSION;
+    config.sequence = configSequence + 1;
+    config.hash = hash;
+    memcpy(config.filamentPositions, filamentPositions, sizeof(filamentPositions));
+    config.extrudeMilimeters = extrudeMilimeters;
+    config.retractMilimeters = retractMilimeters;
+    config.milimetersToStuck = milimetersToStuck;
+    config.nanometersPerRotation = nanometersPerRotation;
+    config.milimetersAcceleration = milimetersAcceleration;
+    config.servoDegreesPerSecond = servoDegreesPerSecond;
+    config.servoSlewEnabled = servoSlewEnabled;
+    config.crc = getConfigCrc(config);
+
+    configSlot = (configSlot + 1) % CONFIG_SLOTS;
+    configSequence = config.sequence;
+    configHash = hash;
+
+    EEPROM.put(getConfigAddress(configSlot), config);
+
+    logInfo(LOG_CONFIG_SAVED, configSlot, configHash);
+}
+
+void syncConfig(const char* cursor) {
+    logInfo(LOG_SYNCING_CONFIG);
+
+    uint16_t hash = getSyncHash(cursor);
+
+    while (*cursor != '\0') {
+        uint8_t option = findKeyword(cursor, SYNC_OPTION_KEYWORDS, SYNC_OPTION_COUNT);
+
+        switch (option) {
+            case SYNC_FILAMENT_POSITIONS: {
+                int newPositions[NUMBER_OF_FILAMENTS];
+                int count = 0;
+
+                while (count < NUMBER_OF_FILAMENTS && parseInt(cursor, newPositions[count])) {
+                    count++;
+                }
+
+                if (count == NUMBER_OF_FILAMENTS) {
+                    memcpy(filamentPositions, newPositions, sizeof(filamentPositions));
+                } else {
+                    logWarn(LOG_INCOMPLETE_FILAMENT_POSITIONS, count);
+                }
+                break;
+            }
+            case SYNC_EXTRUDE_MM:
+                parseLong(cursor, extrudeMilimeters);
+                break;
+
+            case SYNC_RETRACT_MM:
+                parseLong(cursor, retractMilimeters);
+                break;
+
+            case SYNC_MM_PER_ROTATION: {
+                long nanometers;
+
+                if (parseFixed(cursor, nanometers, 6) && nanometers >= MMU_MIN_MM_PER_ROTATION * 1000000L) {
+                    nanometersPerRotation = nanometers;
+                }
+                break;
+            }
+            case SYNC_MM_TO_STUCK:
+                parseLong(cursor, milimetersToStuck);
+                break;
+
+            case SYNC_MM_ACCEL:
+                parseLong(cursor, milimetersAcceleration);
+
+                if (milimetersAcceleration <= 0) {
+                    milimetersAcceleration = MMU_DEFAULT_ACCELERATION;
+                }
+                break;
+
+            case SYNC_SERVO_SPEED:
+                parseLong(cursor, servoDegreesPerSecond);
+
+                if (servoDegreesPerSecond <= 0) {
+                    servoDegreesPerSecond = SERVO_DEFAULT_SPEED;
+                }
+                break;
+
+            case SYNC_SERVO_SLEW: {
+                long slew = 0;
+                parseLong(cursor, slew);
+                servoSlewEnabled = slew != 0;
+                break;
+            }
+            default:
+                skipWord(cursor);
+                break;
+        }
+
+        skipArgumentSeparators(cursor);
+    }
+
+    for (int i = 0; i < NUMBER_OF_FILAMENTS; i++) {
+        logDebug(LOG_SYNC_FILAMENT_POSITION, i + 1, filamentPositions[i]);
+    }
+
+    logDebug(LOG_SYNC_EXTRUDE_MM, extrudeMilimeters);
+    logDebug(LOG_SYNC_RETRACT_MM, retractMilimeters);
+    updateDistanceScale();
+
+    logDebug(LOG_SYNC_UM_PER_ROTATION, nanometersPerRotation / 1000);
+    logDebug(LOG_SYNC_MM_TO_STUCK, milimetersToStuck);
+    logDebug(LOG_SYNC_MM_ACCEL, milimetersAcceleration);
+    logDebug(LOG_SYNC_SERVO_SPEED, servoDegreesPerSecond);
+    logDebug(LOG_SYNC_SERVO_SLEW, servoSlewEnabled);
+    saveConfig(hash);
+    logInfo(LOG_CONFIG_SYNCED);
+    responseOk();
+}
+
+char* getHeapEnd() {
+    return __brkval != NULL ? __brkval : &__heap_start;
+}
+
+// Fills the free RAM between heap and stack with a canary so the deepest stack use can be found later
+void paintStack() {
+    char* end = (char*)(uintptr_t)SP - STACK_PAINT_MARGIN;
+
+    for (char* p = getHeapEnd(); p < end; p++) {
+        *p = STACK_CANARY;
+    }
+}
+
+unsigned int getFreeRamLowWater() {
+    char* start = getHeapEnd();
+    char* p = start;
+
+    while (p < (char*)(uintptr_t)SP && *p == (char)STACK_CANARY) {
+        p++;
+    }
+
+    return p - start;
+}
+
+void recordLoopPeriod() {
+    unsigned long currentMicros = micros();
+
+    if (stats.loopCount > 0 && currentMicros - lastLoopMicros > stats.loopMaxMicros) {
+        stats.loopMaxMicros = currentMicros - lastLoopMicros;
+    }
+
+    lastLoopMicros = currentMicros;
+    stats.loopCount++;
+}
+
+void recordCommandTime(uint8_t command, unsigned long elapsedMillis) {
+    if (command >= COMMAND_COUNT) {
+        return;
+    }
+
+    CommandStats& commandStat = commandStats[command];
+    commandStat.count++;
+    commandStat.totalMillis += elapsedMillis;
+
+    if (elapsedMillis > commandStat.maxMillis) {
+        commandStat.maxMillis = min(elapsedMillis, 0xFFFFUL);
+    }
+}
+
+void resetStats() {
+    memset(&stats, 0, sizeof(stats));
+    memset(commandStats, 0, sizeof(commandStats));
+    stats.resetMillis = millis();
+
+    noInterrupts();
+    hubInterruptCount = 0;
+    stepperMaxLateTicks = 0;
+    stepperCatchUps = 0;
+    interrupts();
+
+    paintStack();
+}
+
+void beginStatsLine(const __FlashStringHelper* group) {
+    serialLink.beginMessage(FRAME_EVENT, 0);
+    serialLink.print(F("STATS "));
+    serialLink.print(group);
+}
+
+void printStat(const __FlashStringHelper* name, unsigned long value) {
+    serialLink.print(' ');
+    serialLink.print(name);
+    serialLink.print('=');
+    serialLink.print(value);
+}
+
+unsigned long getAverage(unsigned long total, unsigned long count) {
+    return count > 0 ? total / count : 0;
+}
+
+// One short line per group so each fits a single frame
+void printStats() {
+    noInterrupts();
+    unsigned long hubInterrupts = hubInterruptCount;
+    unsigned int maxLateTicks = stepperMaxLateTicks;
+    unsigned int catchUps = stepperCatchUps;
+    interrupts();
+
+    beginStatsLine(F("LOOP"));
+    printStat(F("n"), stats.loopCount);
+    printStat(F("avg_us"), getAverage((millis() - stats.resetMillis) * 1000UL, stats.loopCount));
+    printStat(F("max_us"), stats.loopMaxMicros);
+    serialLink.endMessage();
+
+    for (uint8_t i = 0; i < COMMAND_COUNT; i++) {
+        if (commandStats[i].count == 0) {
+            continue;
+        }
+
+        beginStatsLine(F("CMD "));
+        serialLink.print((const __FlashStringHelper*)pgm_read_ptr(&COMMAND_KEYWORDS[i]));
+        printStat(F("n"), commandStats[i].count);
+        printStat(F("avg_ms"), getAverage(commandStats[i].totalMillis, commandStats[i].count));
+        printStat(F("max_ms"), commandStats[i].maxMillis);
+        serialLink.endMessage();
+    }
+
+    beginStatsLine(F("STEP"));
+    printStat(F("req_sps"), stats.requestedStepRate);
+    printStat(F("got_sps"), stats.achievedStepRate);
+    printStat(F("late_us"), maxLateTicks / STEPPER_TICKS_PER_MICROSECOND);
+    printStat(F("catchups"), catchUps);
+    serialLink.endMessage();
+
+    beginStatsLine(F("I2C"));
+    printStat(F("n"), stats.i2cTransactions);
+    printStat(F("avg_us"), getAverage(stats.i2cTotalMicros, stats.sensorReads));
+    printStat(F("max_us"), stats.i2cMaxMicros);
+    serialLink.endMessage();
+
+    beginStatsLine(F("LOG"));
+    printStat(F("dropped"), stats.logRecordsDropped);
+    serialLink.endMessage();
+
+    beginStatsLine(F("HUB"));
+    printStat(F("n"), hubInterrupts);
+    serialLink.endMessage();
+
+    beginStatsLine(F("SRAM"));
+    printStat(F("free_min"), getFreeRamLowWater());
+    serialLink.endMessage();
+}
+
+// One slow search for the hub sensor edge followed by a short overshoot. position follows the
+// filament in steps, positive when extruding, and edge gets where the sensor switched.
+bool runCalibrationPass(bool extruding, long overshootMilimeters, long& position, long& edge) {
+    long searchMilimeters = milimetersToStuck + (extruding ? retractMilimeters : CALIBRATION_OVERSHOOT_MM);
+    unsigned long stepsToHub = getStepsFromMilimeters(searchMilimeters) + 1UL;
+    unsigned long steps = getStepsFromMilimeters(overshootMilimeters);
+    unsigned int interval = getStepperIntervalFromRpm(CALIBRATION_RPM);
+    bool direction = extruding ? MMU_DIRECTION : !MMU_DIRECTION;
+    bool hubTarget = extruding ? LOW : HIGH;
+
+    planStepperRamp(interval);
+
+    StepperMove move = {stepsToHub, steps, interval, direction, true, true, hubTarget, false};
+    startStepperMove(move);
+    waitForStepperMove();
+    processHubEvents();
+
+    long sign = extruding ? 1 : -1;
+    bool found = stepperHubReached && hubCrossingSteps != STEPPER_STEPS_UNLIMITED;
+
+    if (found) {
+        edge = position + sign * (long)hubCrossingSteps;
+    }
+
+    position += sign * (long)getStepperStepsDone();
+    return found;
+}
+
+void getEdgeStatistics(const long* edges, float& mean, float& deviation) {
+    mean = 0;
+    for (int i = 0; i < CALIBRATION_CYCLES; i++) {
+        mean += edges[i];
+    }
+    mean /= CALIBRATION_CYCLES;
+
+    float squares = 0;
+    for (int i = 0; i < CALIBRATION_CYCLES; i++) {
+        squares += (edges[i] - mean) * (edges[i] - mean);
+    }
+    deviation = sqrt(squares / (CALIBRATION_CYCLES - 1));
+}
+
+// Moves the filament of the given slot back and forth across the hub sensor to measure where it
+// switches each way. The gap between both edges is the hysteresis an extrude search has to cover
+// after a retract, so the suggested mm to stuck is that plus three standard deviations.
+bool calibrate(int index) {
+    if (index < 0 || index >= NUMBER_OF_FILAMENTS || filamentStates[index] == HIGH) {
+        logError(LOG_CALIBRATION_NO_FILAMENT, index);
+        return false;
+    }
+
+    if (hubState == LOW) {
+        logError(LOG_CALIBRATION_HUB_LOADED);
+        return false;
+    }
+
+    selectingFilament = index;
+    setMMUServoPosition(filamentPositions[index]);
+    selectingFilament = -1;
+
+    long extrudeEdges[CALIBRATION_CYCLES];
+    long retractEdges[CALIBRATION_CYCLES];
+    long position = 0;
+    int cycle = 0;
+
+    for (; cycle < CALIBRATION_CYCLES; cycle++) {
+        // the last retract parks the filament where a normal retract would
+        long overshoot = cycle == CALIBRATION_CYCLES - 1 ? retractMilimeters : CALIBRATION_OVERSHOOT_MM;
+
+        if (!runCalibrationPass(true, CALIBRATION_OVERSHOOT_MM, position, extrudeEdges[cycle]) ||
+            !runCalibrationPass(false, overshoot, position, retractEdges[cycle])) {
+            break;
+        }
+    }
+
+    Board::EnablePin::high();
+    filamentRelease();
+
+    if (cycle < CALIBRATION_CYCLES) {
+        hubStateStucked = true;
+        logError(LOG_CALIBRATION_FAILED, index, cycle);
+        return false;
+    }
+
+    float extrudeMean, extrudeDeviation, retractMean, retractDeviation;
+    getEdgeStatistics(extrudeEdges, extrudeMean, extrudeDeviation);
+    getEdgeStatistics(retractEdges, retractMean, retractDeviation);
+
+    float deviation = max(extrudeDeviation, retractDeviation);
+    long hysteresisMicrometers = getMicrometersFromSteps(lround(fabs(extrudeMean - retractMean)));
+    long deviationMicrometers = getMicrometersFromSteps(lround(deviation));
+    float confidence = CALIBRATION_T_95 * deviation / sqrt(CALIBRATION_CYCLES);
+    long confidenceMicrometers = getMicrometersFromSteps(lround(confidence));
+    long marginMicrometers = hysteresisMicrometers + 3 * deviationMicrometers + 999;
+    long suggestedMilimetersToStuck = marginMicrometers / 1000 + CALIBRATION_STUCK_MARGIN_MM;
+
+    logInfo(LOG_CALIBRATION_HYSTERESIS, hysteresisMicrometers, deviationMicrometers);
+
+    serialLink.beginMessage(FRAME_EVENT, 0);
+    serialLink.print(F("CALIBRATION T"));
+    serialLink.print(index);
+    printStat(F("hyst_um"), hysteresisMicrometers);
+    printStat(F("sd_um"), deviationMicrometers);
+    printStat(F("ci95_um"), confidenceMicrometers);
+    printStat(F("stuck_mm"), suggestedMilimetersToStuck);
+    serialLink.endMessage();
+
+    return true;
+}
+
+// Toolchange steps SWAP runs in order, the first one that fails ends the swap
+enum SwapStage : uint8_t { SWAP_REENGAGE, SWAP_RETRACT, SWAP_SELECT, SWAP_EXTRUDE, SWAP_RELEASE, SWAP_VERIFY, SWAP_DONE };
+
+const char SWAP_REENGAGE_NAME[] PROGMEM = "REENGAGE";
+const char SWAP_RETRACT_NAME[] PROGMEM = "RETRACT";
+const char SWAP_SELECT_NAME[] PROGMEM = "SELECT";
+const char SWAP_EXTRUDE_NAME[] PROGMEM = "EXTRUDE";
+const char SWAP_RELEASE_NAME[] PROGMEM = "RELEASE";
+const char SWAP_VERIFY_NAME[] PROGMEM = "VERIFY";
+const char SWAP_DONE_NAME[] PROGMEM = "DONE";
+
+// indexed by SwapStage
+const char* const SWAP_STAGE_NAMES[SWAP_DONE + 1] PROGMEM = {
+    SWAP_REENGAGE_NAME, SWAP_RETRACT_NAME, SWAP_SELECT_NAME, SWAP_EXTRUDE_NAME,
+    SWAP_RELEASE_NAME, SWAP_VERIFY_NAME, SWAP_DONE_NAME};
+
+struct SwapRequest {
+    int from;  // -1 when no slot is engaged, skips reengage and retract
+    int to;
+    long retractMilimeters;
+    int retractRpm;
+    long extrudeMilimeters;
+    int extrudeRpm;
+};
+
+bool runSwapStage(uint8_t stage, const SwapRequest& request) {
+    switch (stage) {
+        case SWAP_REENGAGE:
+            // an empty slot is engaged all the same, a runout is what most swaps away from it are for
+            if (request.from >= 0) {
+                selectFilament(request.from);
+            }
+            return true;
+
+        case SWAP_RETRACT:
+            // nothing past the hub sensor, like on the first change of a print
+            if (request.from < 0 || hubState == HIGH) {
+                return true;
+            }
+
+            retract(request.retractMilimeters, request.retractRpm);
+            return !hubStateStucked && hubState == HIGH;
+
+        case SWAP_SELECT:
+            return setFilament(request.to);
+
+        case SWAP_EXTRUDE:
+            extrude(request.extrudeMilimeters, request.extrudeRpm);
+            return !hubStateStucked && hubState == LOW;
+
+        case SWAP_RELEASE:
+            filamentRelease();
+            return true;
+
+        case SWAP_VERIFY:
+            return swapFinish();
+    }
+
+    return false;
+}
+
+// Runs the whole toolchange on the controller and reports it in one line:
+// SWAP T<from> T<to> stage=<DONE or the failed stage> ms=<elapsed>
+bool runSwap(const SwapRequest& request) {
+    unsigned long startMillis = millis();
+    uint8_t stage = SWAP_REENGAGE;
+
+    while (stage < SWAP_DONE && runSwapStage(stage, request)) {
+        stage++;
+    }
+
+    unsigned long elapsedMillis = millis() - startMillis;
+
+    serialLink.beginMessage(FRAME_EVENT, 0);
+    serialLink.print(F("SWAP T"));
+    serialLink.print(request.from);
+    serialLink.print(F(" T"));
+    serialLink.print(request.to);
+    serialLink.print(F(" stage="));
+    serialLink.print((const __FlashStringHelper*)pgm_read_ptr(&SWAP_STAGE_NAMES[stage]));
+    printStat(F("ms"), elapsedMillis);
+    serialLink.endMessage();
+
+    if (stage < SWAP_DONE) {
+        logError(LOG_SWAP_FAILED, stage);
+        return false;
+    }
+
+    logInfo(LOG_SWAPPED, elapsedMillis);
+    return true;
+}
+
+// FEED only starts with the filament already on the hub sensor, gripped by the active slot
+bool engageFeed() {
+    if (activeFilament < 0 || hubState == HIGH) {
+        logError(LOG_FEED_REFUSED);
+        return false;
+    }
+
+    return setFilament(activeFilament);
+}
+
+// Pushes at the extruder's linear speed while it pulls the filament in, so both drives feed together
+// instead of one after the other. Stops early if the filament leaves the hub sensor, and lets go of
+// it once the whole distance went through. Returns the steps done.
+unsigned long feedFilament(long milimeters, long milimetersPerMinute) {
+    unsigned long steps = takeStepsFromMilimeters(milimeters, true);
+    unsigned int interval = getStepperIntervalFromSpeed(milimetersPerMinute);
+
+    planStepperRamp(interval);
+
+    StepperMove move = {0, steps, interval, MMU_DIRECTION, true, true, LOW, false};
+    unsigned long startMicros = micros();
+    startStepperMove(move);
+
+    while (stepperRunning) {
+        if (hubState == HIGH) {
+            noInterrupts();
+            stopStepperMove();
+            interrupts();
+            break;
+        }
+
+        runTasks();
+    }
+
+    recordStepRate(interval, startMicros);
+    Board::EnablePin::high();
+
+    unsigned long stepsDone = getStepperStepsDone();
+
+    // pauses the print like a runout, the load failed with nothing in the extruder
+    if (hubState == HIGH) {
+        hubStateStucked = true;
+        logError(LOG_FEED_LOST_FILAMENT, getMicrometersFromSteps(stepsDone));
+        setMissingFilament();
+        playMIDI(ERROR_MIDI, false);
+        return stepsDone;
+    }
+
+    filamentRelease();
+    logInfo(LOG_FED, getMicrometersFromSteps(stepsDone));
+    return stepsDone;
+}
+
+void switchSerialLink(bool binary, long baudRate) {
+    Serial.flush();
+    Serial.begin(baudRate);
+
+    serialLink.binary = binary;
+    binaryConfirmed = false;
+    commandQueueCount = 0;
+    frameHeld = false;
+    memset(sentResponses, 0, sizeof(sentResponses));  // sequences restart with the new link
+    binaryStartMillis = millis();
+    frameState = FRAME_WAIT_START;
+    serialLineLength = 0;
+    serialLineOverflow = false;
+}
+
+void processCommand(uint8_t command, const char* cursor) {
+    switch (command) {
+        case COMMAND_START:
+            logInfo(LOG_STARTING_UP);
+
+            startingUp = true;
+
+            fillEffectLEDs(BLACK_COLOR);
+            startupLEDs();
+            playMIDI(STARTUP_MIDI, true);
+            waitForMIDI();
+            finishStartupLEDs();
+
+            refreshHubState();
+            readSensors(false);
+
+            started = true;
+            startingUp = false;
+            fillEffectLEDs(LED_TRANSPARENT);
+
+            logInfo(LOG_STARTED);
+
+            sendConfigEvent(F("STARTED"));
+            responseOk();
+            break;
+
+        case COMMAND_SYNC:
+            syncConfig(cursor);
+            break;
+
+        case COMMAND_FILAMENT_RELEASE: {
+            logInfo(LOG_RELEASING_FILAMENT);
+
+            uint8_t operation = acceptOperation();
+            filamentRelease();
+
+            logInfo(LOG_FILAMENT_RELEASED);
+            completeOperation(operation, true, 0);
+            break;
         }
 
-        digitalWrite(MMU_STEP_PIN, HIGH);
-        delayMicroseconds(currentDelay);
-        digitalWrite(MMU_STEP_PIN, LOW);
-        delayMicroseconds(currentDelay);
+        case COMMAND_FILAMENT: {
+            int index = 0;
+            parseInt(cursor, index);
 
-        checkIntervalCount++;
-        skipStepCount++;
-        steps++;
-    }
+            logInfo(LOG_SETTING_FILAMENT, index);
 
-    if (hubStateStucked) {
-        changeLED(activeFilament, ORANGE_COLOR);
-    } else if (hubState == HIGH) {
-        changeLED(activeFilament, DARK_GREEN_COLOR);
-    } else {
-        changeLED(activeFilament, GREEN_COLOR);
-    }
+            uint8_t operation = acceptOperation();
+            bool result = setFilament(index);
 
-    long degrees = getDegreesFromMilimeters(milimeters);
-    bool resetOnSensor = direction != MMU_DIRECTION;  // reset on retract
-    unsigned long extraSteps = rotateMmu(degrees, rpm, false, true, resetOnSensor);
-    steps = steps + extraSteps;
+            if (result) {
+                logInfo(LOG_FILAMENT_SET);
+            } else {
+                logError(LOG_SET_FILAMENT_FAILED, index);
+            }
 
-    long stepsMilimeters = getMilimetersFromSteps(steps);
+            completeOperation(operation, result, 0);
+            break;
+        }
+        case COMMAND_EXTRUDE: {
+            long milimeters = 0;
+            int rpm = 0;
 
-    if (direction == MMU_DIRECTION) {
-        logInfo(F("Extruded milimeters: "), String(stepsMilimeters));
+            parseLong(cursor, milimeters);
+            parseInt(cursor, rpm);
 
-    } else if (direction != MMU_DIRECTION) {
-        logInfo(F("Retracted milimeters: "), String(stepsMilimeters));
-    }
+            logInfo(LOG_EXTRUDING);
 
-    digitalWrite(MMU_ENABLE_PIN, HIGH);
-}
+            uint8_t operation = acceptOperation();
+            unsigned long steps = extrude(milimeters, rpm);
 
-void extrude(long milimeters, int rpm) {
-    long totalMilimetersToStuck = milimetersToStuck + retractMilimeters;
-    rotateMmuToSensor(LOW, milimeters, totalMilimetersToStuck, MMU_DIRECTION, rpm);
-}
+            logInfo(LOG_EXTRUDED);
+            completeOperation(operation, !hubStateStucked, steps);
+            break;
+        }
+        case COMMAND_RETRACT: {
+            long milimeters = 0;
+            int rpm = 0;
 
-void retract(long milimeters, int rpm) {
-    long totalMilimetersToStuck = milimetersToStuck + extrudeMilimeters;
-    rotateMmuToSensor(HIGH, milimeters, totalMilimetersToStuck, !MMU_DIRECTION, rpm);
-}
+            parseLong(cursor, milimeters);
+            parseInt(cursor, rpm);
 
-void readHubState() {
-    if (hubState != lastHubState) {
-        logInfo(F("Hub state changed to "), String(hubState));
-        lastHubState = hubState;
+            logInfo(LOG_RETRACTING);
 
-        if (activeFilament > -1 && filamentStates[activeFilament] == LOW && !hubStateStucked) {
-            if (hubState == HIGH) {
-                changeLED(activeFilament, DARK_GREEN_COLOR);
+            uint8_t operation = acceptOperation();
+            waitMillis(100);
+
+            unsigned long steps = retract(milimeters, rpm);
+
+            logInfo(LOG_RETRACTED);
+            completeOperation(operation, !hubStateStucked, steps);
+            break;
+        }
+        case COMMAND_SWAP_FINISH: {
+            logInfo(LOG_SWAP_FINISHING);
+            bool finished = swapFinish();
+
+            if (finished) {
+                logInfo(LOG_SWAP_FINISHED);
+                responseOk();
             } else {
-                changeLED(activeFilament, GREEN_COLOR);
-                unsetMissingFilament();
+                logInfo(LOG_SWAP_NOT_FINISHED);
+                responseError();
             }
+            break;
         }
-    }
-}
+        case COMMAND_CUTTER_POSITION: {
+            int position = 0;
+            parseInt(cursor, position);
+            bool async = matchKeyword(cursor, PSTR("ASYNC"));
 
-void readSensors(bool soundEnabled) {
-    for (int i = 0; i < NUMBER_OF_FILAMENTS; i++) {
-        int pin = FILAMENT_SENSOR_PINS[i];
-        bool state = mcp.digitalRead(pin);
-        if (state != filamentStates[i]) {
-            filamentStates[i] = state;
+            logInfo(LOG_SETTING_CUTTER_POSITION, position);
 
-            if (state == LOW) {
-                logInfo("Filament T" + String(i) + " inserted", "");
+            uint8_t operation = acceptOperation();
 
-                if (i == activeFilament) {
-                    unsetMissingFilament();
+            if (async) {
+                startCutterServoMove(position);
+                cutterServoMotion.operation = operation;  // DONE once the servo settles
+            } else {
+                setCutterServoPosition(position);
+                logInfo(LOG_CUTTER_POSITION_SET, position);
+                completeOperation(operation, true, 0);
+            }
+            break;
+        }
+        case COMMAND_MMU_POSITION: {
+            int position = 0;
+            parseInt(cursor, position);
+            bool async = matchKeyword(cursor, PSTR("ASYNC"));
 
-                    if (hubStateStucked) {
-                        changeLED(activeFilament, ORANGE_COLOR);
-                    } else {
-                        changeLED(activeFilament, GREEN_COLOR);
-                    }
+            logInfo(LOG_SETTING_MMU_POSITION, position);
 
-                } else {
-                    changeLED(i, CYAN_COLOR);
-                }
+            uint8_t operation = acceptOperation();
 
-                if (soundEnabled) {
-                    filamentInsertedMIDI(false);
-                }
+            if (async) {
+                startMMUServoMove(position);
+                mmuServoMotion.operation = operation;  // DONE once the servo settles
+            } else {
+                setMMUServoPosition(position);
+                logInfo(LOG_MMU_POSITION_SET, position);
+                completeOperation(operation, true, 0);
+            }
+            break;
+        }
+        case COMMAND_MMU_ROTATE: {
+            long degrees = 0;
+            int rpm = 0;
 
+            parseLong(cursor, degrees);
+            parseInt(cursor, rpm);
+
+            logInfo(LOG_ROTATING_MMU, degrees, rpm);
+
+            uint8_t operation = acceptOperation();
+            unsigned long steps = rotateMmu(degrees, rpm, true, true, false);
+
+            logInfo(LOG_MMU_ROTATED, degrees);
+            completeOperation(operation, true, steps);
+            break;
+        }
+        case COMMAND_MIDI: {
+            int position = 0;
+            parseInt(cursor, position);
+
+            logInfo(LOG_PLAYING_MIDI, position);
+            bool played = playMIDI(position);
+            if (played) {
+                logInfo(LOG_MIDI_QUEUED);
+                responseOk();
             } else {
-                logInfo("Filament T" + String(i) + " removed", "");
+                logError(LOG_PLAY_MIDI_FAILED, position);
+                responseError();
+            }
+            break;
+        }
+        case COMMAND_TEST_LEDS:
+            logInfo(LOG_TESTING_LEDS);
 
-                if (i == activeFilament) {
-                    setMissingFilament();
+            testLEDs();
+            logInfo(LOG_LEDS_TESTED);
+            responseOk();
+            break;
 
-                    changeLED(i, RED_COLOR);
+        case COMMAND_TEST_LED: {
+            int index = 0;
+            parseInt(cursor, index);
 
-                    if (soundEnabled) {
-                        errorMIDI(false);
-                    }
+            logInfo(LOG_TESTING_LED, index);
 
-                    blinkLED(i, RED_COLOR);
+            safeTestLED(index - 1);
 
-                } else {
-                    changeLED(i, BLACK_COLOR);
+            logInfo(LOG_LED_TESTED);
+            responseOk();
+            break;
+        }
+        case COMMAND_BINARY: {
+            long baudRate = 0;
+            parseLong(cursor, baudRate);
+
+            if (baudRate != 115200 && baudRate != 250000) {
+                logError(LOG_UNSUPPORTED_BAUD_RATE, baudRate);
+                responseError();
+                break;
+            }
 
-                    if (soundEnabled) {
-                        filamentRemovedMIDI(false);
-                    }
-                }
+            logInfo(LOG_SWITCHING_TO_BINARY, baudRate);
+            responseOk();
+            switchSerialLink(true, baudRate);
+            break;
+        }
+        case COMMAND_LOG_DUMP:
+            dumpLogs();
+            responseOk();
+            break;
+
+        case COMMAND_LOG_LEVEL: {
+            long level = LOG_LEVEL_INFO;
+            parseLong(cursor, level);
+
+            logLevel = constrain(level, (long)LOG_LEVEL_DEBUG, (long)LOG_LEVEL_ERROR);
+            logInfo(LOG_LEVEL_CHANGED, logLevel);
+            responseOk();
+            break;
+        }
+        case COMMAND_STATS:
+            printStats();
+            responseOk();
+            break;
+
+        case COMMAND_STATS_RESET:
+            resetStats();
+            responseOk();
+            break;
+
+        case COMMAND_CALIBRATE: {
+            int index = activeFilament;
+            parseInt(cursor, index);
+
+            logInfo(LOG_CALIBRATING, index);
+
+            uint8_t operation = acceptOperation();
+            bool calibrated = calibrate(index);
+
+            if (calibrated) {
+                logInfo(LOG_CALIBRATED);
+            }
+
+            completeOperation(operation, calibrated, 0);
+            break;
+        }
+        case COMMAND_SWAP: {
+            SwapRequest request = {activeFilament, -1, retractMilimeters, 0, extrudeMilimeters, 0};
+
+            parseInt(cursor, request.from);
+            parseInt(cursor, request.to);
+            parseLong(cursor, request.retractMilimeters);
+            parseInt(cursor, request.retractRpm);
+            parseLong(cursor, request.extrudeMilimeters);
+            parseInt(cursor, request.extrudeRpm);
+
+            logInfo(LOG_SWAPPING, request.from, request.to);
+
+            // -1 only makes sense as the slot swapped from, when none is engaged yet
+            if (request.from < -1 || request.from >= NUMBER_OF_FILAMENTS || request.to < 0 ||
+                request.to >= NUMBER_OF_FILAMENTS) {
+                logError(LOG_SWAP_REFUSED, request.from, request.to);
+                responseError();
+                break;
+            }
+
+            uint8_t operation = acceptOperation();
+            completeOperation(operation, runSwap(request), 0);
+            break;
+        }
+        case COMMAND_FEED: {
+            long milimeters = 0;
+            long milimetersPerMinute = FEED_DEFAULT_SPEED;
+            long leadMillis = 0;
+
+            parseLong(cursor, milimeters);
+            parseLong(cursor, milimetersPerMinute);
+            parseLong(cursor, leadMillis);
+
+            logInfo(LOG_FEEDING, milimeters, milimetersPerMinute);
+
+            if (milimeters <= 0 || milimetersPerMinute <= 0 || leadMillis < 0 || leadMillis > FEED_MAX_LEAD) {
+                logError(LOG_FEED_INVALID, milimeters, milimetersPerMinute);
+                responseError();
+                break;
+            }
+
+            // accepted once gripped. The extruder move the host sends on the ACK starts about lead ms
+            // later, once the printer's lookahead lets it go, so the stepper holds off that long.
+            if (!engageFeed()) {
+                responseError();
+                break;
             }
+
+            uint8_t operation = acceptOperation();
+            waitMillis(leadMillis);
+
+            unsigned long steps = feedFilament(milimeters, milimetersPerMinute);
+            completeOperation(operation, hubState == LOW, steps);
+            break;
         }
+
+        default:
+            logError(LOG_UNKNOWN_COMMAND);
+            responseError();
+            break;
     }
 }
 
-unsigned long actionButtonPressedTime = 0;
+void runCommand(uint8_t command, const char* cursor) {
+    unsigned long startMillis = millis();
 
-void readActionButtonPressed() {
-    bool state = mcp.digitalRead(ACTION_BUTTON_PIN);
+    commandRunning = true;
+    BENCH_BEGIN(BENCH_COMMAND + command);
+    processCommand(command, cursor);
+    BENCH_END(BENCH_COMMAND + command);
+    commandRunning = false;
+    recordCommandTime(command, millis() - startMillis);
+}
 
-    if (state == LOW && actionButtonPressedTime == 0) {
-        actionButtonPressedTime = millis();
-    }
+void processSerialInput(const char* line) {
+    const char* cursor = line;
+    uint8_t command = findKeyword(cursor, COMMAND_KEYWORDS, COMMAND_COUNT);
 
-    if (state == HIGH && actionButtonPressedTime > 0) {
-        unsigned long buttonPressedDuration = millis() - actionButtonPressedTime;
-        actionButtonPressedTime = 0;
+    runCommand(command, cursor);
+}
 
-        buttonClickSound();
+SentResponse* findSentResponse(uint8_t sequence) {
+    for (uint8_t i = 0; i < COMMAND_QUEUE_SIZE; i++) {
+        if (sentResponses[i].sequence == sequence && sentResponses[i].response != NULL) {
+            return &sentResponses[i];
+        }
+    }
 
-        if (buttonPressedDuration > 1000) {
-            logInfo(F("Action button pressed long"), "");
+    return NULL;
+}
 
-            if (activeFilament > -1 && filamentStates[activeFilament] == LOW && hubState == HIGH) {
-                autoExtruding = true;
-                int mmuPosition = filamentPositions[activeFilament];
+QueuedCommand& getQueuedCommand(uint8_t position) {
+    return commandQueue[(commandQueueHead - commandQueueCount + position) & (COMMAND_QUEUE_SIZE - 1)];
+}
 
-                changeLED(activeFilament, WHITE_COLOR);
-                setMMUServoPosition(mmuPosition);
-                extrude(extrudeMilimeters, MMU_DEFAULT_RPM);
-                filamentRelease();
-                autoExtruding = false;
-            }
-        } else {
-            logInfo(F("Action button pressed short"), "");
-            filamentRelease();
+bool isQueuedSequence(uint8_t sequence) {
+    for (uint8_t i = 0; i < commandQueueCount; i++) {
+        if (getQueuedCommand(i).sequence == sequence) {
+            return true;
         }
     }
+
+    return frameHeld && frameSequence == sequence;
 }
 
-void processSerialInput() {
-    String input = Serial.readStringUntil('\n');
-    input.toUpperCase();
-    input.trim();
+// Moves the request waiting in serialLine into the queue once a slot is free
+void queueHeldFrame() {
+    if (!frameHeld || frameLength >= COMMAND_QUEUE_PAYLOAD_SIZE || commandQueueCount == COMMAND_QUEUE_SIZE) {
+        return;
+    }
+
+    QueuedCommand& queued = commandQueue[commandQueueHead];
+    queued.type = frameType;
+    queued.sequence = frameSequence;
+    memcpy(queued.payload, serialLine, frameLength + 1);
+
+    commandQueueHead = (commandQueueHead + 1) & (COMMAND_QUEUE_SIZE - 1);
+    commandQueueCount++;
+    frameHeld = false;
+}
 
-    if (input == F("START")) {
-        logInfo(F("Starting up..."), "");
+// Called from the parser, also while a command runs: PINGs and retransmits are answered right
+// away, requests are queued for loop() to run in order.
+void processFrame() {
+    binaryConfirmed = true;
 
-        disableLEDs();
-        startupLEDs();
-        startupMIDI(true);
-        finishStartupLEDs();
+    if (frameType == FRAME_PING) {
+        writeResponse(frameSequence, F("OK"));
+        return;
+    }
 
-        changeHubState();
-        readSensors(false);
+    // a retransmitted request that was already handled only gets its response again
+    SentResponse* sent = findSentResponse(frameSequence);
+    if (frameSequence != 0 && sent != NULL) {
+        writeResponse(frameSequence, sent->response, sent->operation);
+        return;
+    }
 
-        started = true;
+    // still queued, it answers once it runs. Tells the host so it stops counting retries.
+    if (isQueuedSequence(frameSequence)) {
+        serialLink.beginMessage(FRAME_PENDING, frameSequence);
+        serialLink.endMessage();
+        return;
+    }
 
-        logInfo(F("Started"), "");
+    frameHeld = true;
+    queueHeldFrame();
+}
 
-        responseOk();
+// Returns false when the request failed and asked for the ones behind it to be skipped
+bool runFrame(uint8_t type, uint8_t sequence, const char* payload) {
+    requestSequence = sequence;
+    commandFailed = false;
 
-    } else if (input.startsWith(F("SYNC"))) {
-        logInfo(F("Syncing config..."), "");
+    runCommand(type & ~FRAME_ABORT_ON_ERROR, payload);
 
-        int newPositions[NUMBER_OF_FILAMENTS];
+    requestSequence = 0;
+    return !(commandFailed && (type & FRAME_ABORT_ON_ERROR));
+}
 
-        const char* inputStr = input.c_str();
+void skipQueuedCommands() {
+    uint8_t skipped = 0;
 
-        const char* posStr = strstr(inputStr, "FILAMENT_POSITIONS");
-        if (posStr) {
-            sscanf(posStr, "FILAMENT_POSITIONS %d %d %d %d %d %d %d %d",
-                   &newPositions[0], &newPositions[1], &newPositions[2], &newPositions[3],
-                   &newPositions[4], &newPositions[5], &newPositions[6], &newPositions[7]);
+    while (commandQueueCount > 0 || frameHeld) {
+        if (commandQueueCount > 0) {
+            requestSequence = getQueuedCommand(0).sequence;
+            commandQueueCount--;
+        } else {
+            requestSequence = frameSequence;
+            frameHeld = false;
         }
 
-        const char* extStr = strstr(inputStr, "EXTRUDE_MM");
-        if (extStr) {
-            sscanf(extStr, "EXTRUDE_MM %ld", &extrudeMilimeters);
-        }
+        sendResponse(F("ERROR SKIPPED"));
+        skipped++;
+    }
 
-        const char* rtrStr = strstr(inputStr, "RETRACT_MM");
-        if (rtrStr) {
-            sscanf(rtrStr, "RETRACT_MM %ld", &retractMilimeters);
-        }
+    requestSequence = 0;
+    logWarn(LOG_COMMANDS_SKIPPED, skipped);
+}
 
-        const char* mmPerRotStr = strstr(inputStr, "MM_PER_ROTATION");
-        if (mmPerRotStr) {
-            sscanf(mmPerRotStr, "MM_PER_ROTATION %lf", &milimetersPerRotation);
-        }
+// Runs the oldest queued request. Its slot stays taken until it is done, so the parser can keep
+// queueing the next ones into the free slots meanwhile.
+void runQueuedCommands() {
+    queueHeldFrame();
 
-        const char* mmToStkStr = strstr(inputStr, "MM_TO_STUCK");
-        if (mmToStkStr) {
-            sscanf(mmToStkStr, "MM_TO_STUCK %ld", &milimetersToStuck);
-        }
+    bool succeeded = true;
 
-        logInfo(F("New positions: "), "");
-        for (int i = 0; i < NUMBER_OF_FILAMENTS; i++) {
-            logInfo(String(i + 1) + " => " + String(filamentPositions[i]), "");
+    if (commandQueueCount > 0) {
+        QueuedCommand& queued = getQueuedCommand(0);
+        succeeded = runFrame(queued.type, queued.sequence, queued.payload);
+
+        if (commandQueueCount > 0) {
+            commandQueueCount--;
         }
 
-        logInfo(F("New extrude mm: "), String(extrudeMilimeters));
-        logInfo(F("New retract mm: "), String(retractMilimeters));
-        logInfo(F("New mm per rotation: "), String(milimetersPerRotation));
-        logInfo(F("New mm to stuck: "), String(milimetersToStuck));
-        logInfo(F("Config synced"), "");
-        responseOk();
+    } else if (frameHeld) {
+        // too long for a slot, runs straight from serialLine with reading stopped
+        succeeded = runFrame(frameType, frameSequence, serialLine);
+        frameHeld = false;
+    }
 
-    } else if (input.startsWith(F("FILAMENT_RELEASE"))) {
-        logInfo(F("Releasing filament"), "");
+    if (!succeeded) {
+        skipQueuedCommands();
+    }
+}
 
-        responseOk();  // async
-        filamentRelease();
+// Returns true once a complete frame was handled
+bool readFrameByte(uint8_t value) {
+    switch (frameState) {
+        case FRAME_WAIT_START:
+            if (value == FRAME_START) {
+                frameCrc = 0;
+                frameState = FRAME_WAIT_TYPE;
+            }
+            return false;
 
-        logInfo(F("Filament released"), "");
+        case FRAME_WAIT_TYPE:
+            frameType = value;
+            frameState = FRAME_WAIT_SEQUENCE;
+            break;
 
-    } else if (input.startsWith(F("FILAMENT"))) {
-        int index = input.substring(input.indexOf(' ') + 1).toInt();
-        logInfo(F("Setting filament T"), String(index));
+        case FRAME_WAIT_SEQUENCE:
+            frameSequence = value;
+            frameState = FRAME_WAIT_LENGTH;
+            break;
 
-        bool result = setFilament(index);
+        case FRAME_WAIT_LENGTH:
+            if (value >= SERIAL_LINE_SIZE) {
+                frameState = FRAME_WAIT_START;
+                return false;
+            }
 
-        if (result) {
-            logInfo(F("Filament set"), "");
-            responseOk();
-        } else {
-            logError(F("Failed to set filament T"), String(index));
-            responseError();
-        }
-    } else if (input.startsWith(F("EXTRUDE"))) {
-        long milimeters = 0;
-        int rpm = 0;
+            frameLength = value;
+            serialLineLength = 0;
+            frameState = value > 0 ? FRAME_WAIT_PAYLOAD : FRAME_WAIT_CRC;
+            break;
+
+        case FRAME_WAIT_PAYLOAD:
+            serialLine[serialLineLength++] = toupper(value);
+
+            if (serialLineLength == frameLength) {
+                frameState = FRAME_WAIT_CRC;
+            }
+            break;
+
+        case FRAME_WAIT_CRC:
+            frameState = FRAME_WAIT_START;
+            serialLine[serialLineLength] = '\0';
+
+            if (value != frameCrc) {
+                serialLink.beginMessage(FRAME_NAK, frameSequence);
+                serialLink.endMessage();
+                return false;
+            }
 
-        sscanf(input.c_str(), "EXTRUDE %ld %d", &milimeters, &rpm);
+            processFrame();
+            return true;
+    }
+
+    frameCrc = _crc8_ccitt_update(frameCrc, value);
+    return false;
+}
+
+// Drains whatever the UART has buffered into the line buffer without waiting for the rest of the
+// line, so a partial command never stalls the scheduler.
+void readSerialInput() {
+    if (serialLink.binary && !binaryConfirmed && millis() - binaryStartMillis > BINARY_CONFIRM_TIMEOUT) {
+        switchSerialLink(false, BAUD_RATE);
+        logWarn(LOG_BINARY_TIMEOUT);
+    }
 
-        logInfo(F("Extruding..."), "");
-        extrude(milimeters, rpm);
-        logInfo(F("Extruded"), "");
-        responseOk();
+    if (serialLink.binary) {
+        while (!frameHeld && Serial.available() > 0) {
+            frameByteMillis = millis();
+            readFrameByte(Serial.read());
+        }
 
-    } else if (input.startsWith(F("RETRACT"))) {
-        long milimeters = 0;
-        int rpm = 0;
+        // a frame that lost bytes on the wire would otherwise wait forever for the rest of it,
+        // the host resends it after getting no answer
+        if (frameState != FRAME_WAIT_START && millis() - frameByteMillis > FRAME_BYTE_TIMEOUT) {
+            frameState = FRAME_WAIT_START;
+            logWarn(LOG_FRAME_TIMEOUT, frameSequence);
+        }
+        return;
+    }
 
-        sscanf(input.c_str(), "RETRACT %ld %d", &milimeters, &rpm);
+    while (Serial.available() > 0) {
 
-        logInfo(F("Retracting..."), "");
+        char c = Serial.read();
 
-        responseOk();  // async
-        delay(100);
+        if (c == '\n') {
+            serialLine[serialLineLength] = '\0';
 
-        retract(milimeters, rpm);
-        logInfo(F("Retracted"), "");
+            if (serialLineOverflow) {
+                logError(LOG_COMMAND_TOO_LONG);
+                responseError();
+            } else {
+                processSerialInput(serialLine);
+            }
 
-    } else if (input.startsWith(F("SWAP_FINISH"))) {
-        logInfo(F("Swap finishing..."), "");
-        bool finished = swapFinish();
+            serialLineLength = 0;
+            serialLineOverflow = false;
+            return;
+        }
 
-        if (finished) {
-            logInfo(F("Swap finished"), "");
-            responseOk();
+        if (c == '\r') {
+            continue;
+        }
+
+        if (serialLineLength < SERIAL_LINE_SIZE - 1) {
+            serialLine[serialLineLength++] = toupper(c);
         } else {
-            logInfo(F("Swap not finished"), "");
-            responseError();
+            serialLineOverflow = true;
         }
+    }
+}
 
-    } else if (input.startsWith(F("CUTTER_POSITION"))) {
-        int position = input.substring(input.indexOf(' ') + 1).toInt();
+// Bytes are waiting or a line or frame is half received, more are likely on the way
+bool isSerialInputPending() {
+    if (serialLink.binary) {
+        return Serial.available() > 0 || frameState != FRAME_WAIT_START;
+    }
 
-        logInfo(F("Setting cutter position to "), String(position));
-        setCutterServoPosition(position);
-        logInfo(F("Cutter position set to "), String(position));
+    return Serial.available() > 0 || serialLineLength > 0;
+}
 
-        responseOk();
+// Flushes the frame with a single show(), only when a pixel actually changed. Never while
+// stepping: show() keeps interrupts off for the whole strip and would stall the step timer.
+// Nor while serial input is coming in, at 250000 baud the UART overruns long before show() ends.
+void updateLEDs() {
+    if (stepperRunning || isSerialInputPending()) {
+        return;
+    }
 
-    } else if (input.startsWith(F("MMU_POSITION"))) {
-        int position = input.substring(input.indexOf(' ') + 1).toInt();
+    bool changed = false;
 
-        logInfo(F("Setting MMU position to "), String(position));
-        setMMUServoPosition(position);
-        logInfo(F("MMU position set to "), String(position));
-        responseOk();
+    for (int i = 0; i < NUMBER_OF_FILAMENTS; i++) {
+        uint8_t color = composeLED(i);
 
-    } else if (input.startsWith(F("MMU_ROTATE"))) {
-        long degrees = 0;
-        int rpm = 0;
+        if (color != ledFrame[i]) {
+            ledFrame[i] = color;
+            pixels.setPixelColor(FILAMENT_LEDS[i], getPaletteColor(color));
+            changed = true;
+        }
+    }
 
-        sscanf(input.c_str(), "MMU_ROTATE %ld %d", &degrees, &rpm);
+    if (changed) {
+        BENCH_BEGIN(BENCH_PIXELS_SHOW);
+        pixels.show();
+        BENCH_END(BENCH_PIXELS_SHOW);
+    }
+}
 
-        logInfo(F("Rotating MMU "), String(degrees));
-        logInfo(F("RPM "), String(rpm));
-        rotateMmu(degrees, rpm, true, true, false);
-        logInfo(F("MMU rotated "), String(degrees));
-        responseOk();
+void sensorTask() {
+    updateInputs();
+    processHubEvents();
 
-    } else if (input.startsWith(F("MIDI"))) {
-        int position = input.substring(input.indexOf(' ') + 1).toInt();
-        logInfo(F("Playing MIDI "), String(position));
-        bool played = playMIDI(position);
-        if (played) {
-            logInfo(F("MIDI played"), "");
-            responseOk();
-        } else {
-            logError(F("Failed to play MIDI "), String(position));
-            responseError();
-        }
+    if (started) {
+        readSensors(true);
+        readHubState();
+        readActionButtonPressed();
+    }
+}
 
-    } else if (input.startsWith(F("TEST_LEDS"))) {
-        logInfo(F("Testing LEDs..."), "");
+void servoTask() {
+    updateServoMove(mmuServoMotion);
+    updateServoMove(cutterServoMotion);
+}
 
-        testLEDs();
-        logInfo(F("LEDs tested"), "");
-        responseOk();
+void melodyTask() {
+    updateMIDI();
+}
 
-    } else if (input.startsWith(F("TEST_LED"))) {
-        int index = input.substring(input.indexOf(' ') + 1).toInt();
-        logInfo(F("Testing LED "), String(index));
+void ledTask() {
+    if (!started && !startingUp) {
+        blinkStartupLEDs();
+    }
 
-        safeTestLED(index - 1);
+    updateLEDTest();
+    updateLEDs();
+}
 
-        logInfo(F("LED tested"), "");
-        responseOk();
+// Binary requests are read even while a command runs, so the host can stream the next ones
+void serialTask() {
+    if (serialLink.binary) {
+        readSerialInput();
+    }
+}
 
-    } else {
-        logError(F("Unknown command "), input);
-        responseError();
+void heartbeatTask() {
+    if (started) {
+        checkAlive();
     }
 }
 
+void setupTasks() {
+    addTask(sensorTask, 0);
+    addTask(servoTask, 0);
+    addTask(melodyTask, 0);
+    addTask(ledTask, LED_FRAME_INTERVAL);
+    addTask(heartbeatTask, 0);
+    addTask(serialTask, 0);
+}
+
 void setup() {
+    resetStats();
+
     Serial.begin(BAUD_RATE);
-    logInfo(F("Starting..."), "");
+    logInfo(LOG_STARTING);
+
+    loadConfig();
+    updateDistanceScale();
 
     randomSeed(analogRead(0));
 
     pixels.begin();
+    setupTasks();
 
-    pinMode(FILAMENT_HUB_SENSOR_PIN, INPUT_PULLUP);
-    hubState = digitalRead(FILAMENT_HUB_SENSOR_PIN);
+    Board::HubSensorPin::inputPullup();
+    hubState = Board::HubSensorPin::read();
     lastHubState = hubState;
-    attachInterrupt(digitalPinToInterrupt(FILAMENT_HUB_SENSOR_PIN), changeHubState, CHANGE);
+    attachInterrupt(digitalPinToInterrupt(Board::HubSensorPin::NUMBER), changeHubState, CHANGE);
 
-    pinMode(MMU_DIR_PIN, OUTPUT);
-    pinMode(MMU_STEP_PIN, OUTPUT);
-    pinMode(MMU_ENABLE_PIN, OUTPUT);
-    digitalWrite(MMU_ENABLE_PIN, HIGH);
+    setupStepper();
 
-    setCutterServoPosition(0);
-    setMMUServoPosition(0);
+    startCutterServoMove(0);
+    startMMUServoMove(0);
+    waitForServoMove(cutterServoMotion);
+    waitForServoMove(mmuServoMotion);
 
     if (!mcp.begin_I2C()) {
-        logError(F("Failed to initialize MCP23017"), "");
+        logError(LOG_MCP23017_INIT_FAILED);
         blinkErrorLEDs();
     }
 
@@ -1048,29 +3424,22 @@ void setup() {
     mcp.pinMode(FILAMENT_SIX_SENSOR_PIN, INPUT_PULLUP);
     mcp.pinMode(FILAMENT_SEVEN_SENSOR_PIN, INPUT_PULLUP);
     mcp.pinMode(FILAMENT_EIGHT_SENSOR_PIN, INPUT_PULLUP);
+    setupInputs();
 
     mmuServo.detach();
     cutterServo.detach();
 
-    Serial.println("READY");
+    sendConfigEvent(F("READY"));
 }
 
 void loop() {
-    if (Serial.available() > 0) {
-        processSerialInput();
-    }
-
-    if (started) {
-        readSensors(true);
-        readHubState();
-        readActionButtonPressed();
+    recordLoopPeriod();
+    runTasks();
 
-        unsigned long currentMillis = millis();
-        if (currentMillis - previousAliveMessageMillis > ALIVE_MESSAGE_INTERVAL) {
-            responseAlive();
-            previousAliveMessageMillis = currentMillis;
-        }
-    } else {
-        blinkStartupLEDs();
+    if (!serialLink.binary) {
+        readSerialInput();
     }
-}
\ No newline at end of file
+
+    runQueuedCommands();
+    runActionButton();
+}
@@ -0,0 +1,398 @@
+// Command set tests against the native build: the firmware runs its real setup() and loop() on the
+// mock hardware, commands go in over a pipe and the tests check what comes back out.
+//
+//   pio test -e native
+
+#include <Arduino.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <unity.h>
+#include <util/crc16.h>
+
+#include "native_hal.h"
+
+void setup();
+void loop();
+
+#define TEST_TIMEOUT 60000  // virtual ms to wait for an answer
+#define TEST_HUB_STEPS 1000
+#define TEST_RECEIVE_SIZE 4096
+#define TEST_LINE_SIZE 128
+
+// Same values as in src/main.cpp
+#define FRAME_START 0xA5
+#define FRAME_PING 0x40
+#define FRAME_ABORT_ON_ERROR 0x20
+#define FRAME_RESPONSE 0x81
+#define FRAME_NAK 0x83
+#define FRAME_PENDING 0x84
+#define COMMAND_START 0
+#define COMMAND_SWAP 19
+#define COMMAND_LOG_LEVEL 15
+
+int serialInput;   // write end of what the firmware reads
+int serialOutput;  // read end of what it writes
+
+uint8_t received[TEST_RECEIVE_SIZE];
+size_t receivedLength = 0;
+
+char line[TEST_LINE_SIZE];
+char framePayload[TEST_LINE_SIZE];
+
+void readReceived() {
+    Serial.flush();
+
+    ssize_t count = read(serialOutput, received + receivedLength, sizeof(received) - receivedLength);
+
+    if (count > 0) {
+        receivedLength += count;
+    }
+}
+
+void consumeReceived(size_t length) {
+    memmove(received, received + length, receivedLength - length);
+    receivedLength -= length;
+}
+
+void sendLine(const char* text) {
+    write(serialInput, text, strlen(text));
+    write(serialInput, "\n", 1);
+}
+
+// Runs the firmware until a text line starting with prefix comes out, dropping the lines before it
+bool waitForLine(const char* prefix) {
+    unsigned long startMillis = millis();
+
+    while (millis() - startMillis < TEST_TIMEOUT) {
+        loop();
+        readReceived();
+
+        uint8_t* end;
+
+        while ((end = (uint8_t*)memchr(received, '\n', receivedLength)) != NULL) {
+            size_t length = end - received + 1;
+            size_t textLength = min(length - 1, (size_t)TEST_LINE_SIZE - 1);
+
+            memcpy(line, received, textLength);
+            line[textLength] = '\0';
+
+            if (textLength > 0 && line[textLength - 1] == '\r') {
+                line[textLength - 1] = '\0';
+            }
+
+            consumeReceived(length);
+
+            if (strncmp(line, prefix, strlen(prefix)) == 0) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+// The answer to a text command: OK, OK OP=<id> or ERROR
+const char* sendCommand(const char* command) {
+    sendLine(command);
+
+    unsigned long startMillis = millis();
+
+    while (millis() - startMillis < TEST_TIMEOUT) {
+        if (!waitForLine("")) {
+            break;
+        }
+
+        if (strncmp(line, "OK", 2) == 0 || strncmp(line, "ERROR", 5) == 0) {
+            return line;
+        }
+    }
+
+    return "";
+}
+
+// Sends a motion command and waits for its DONE line, which ends up in line
+bool runOperation(const char* command) {
+    const char* response = sendCommand(command);
+
+    if (strncmp(response, "OK OP=", 6) != 0) {
+        return false;
+    }
+
+    char prefix[16];
+    snprintf(prefix, sizeof(prefix), "DONE %d ", atoi(response + 6));
+
+    return waitForLine(prefix);
+}
+
+void runFor(unsigned long milliseconds) {
+    unsigned long startMillis = millis();
+
+    while (millis() - startMillis < milliseconds) {
+        loop();
+    }
+}
+
+void sendFrame(uint8_t type, uint8_t sequence, const char* payload, bool corrupt = false) {
+    uint8_t frame[TEST_LINE_SIZE];
+    uint8_t length = strlen(payload);
+    uint8_t crc = 0;
+
+    frame[0] = FRAME_START;
+    frame[1] = type;
+    frame[2] = sequence;
+    frame[3] = length;
+    memcpy(frame + 4, payload, length);
+
+    for (uint8_t i = 1; i < length + 4; i++) {
+        crc = _crc8_ccitt_update(crc, frame[i]);
+    }
+
+    frame[length + 4] = corrupt ? crc ^ 0xFF : crc;
+    write(serialInput, frame, length + 5);
+}
+
+// Runs the firmware until a frame of the given type and sequence comes out, its payload ends up in
+// framePayload. Frames before it and bytes outside of frames are dropped.
+bool waitForFrame(uint8_t type, uint8_t sequence) {
+    unsigned long startMillis = millis();
+
+    while (millis() - startMillis < TEST_TIMEOUT) {
+        loop();
+        readReceived();
+
+        while (receivedLength > 0) {
+            if (received[0] != FRAME_START) {
+                consumeReceived(1);
+                continue;
+            }
+
+            if (receivedLength < 4 || receivedLength < (size_t)received[3] + 5) {
+                break;
+            }
+
+            uint8_t length = received[3];
+            uint8_t crc = 0;
+
+            for (uint8_t i = 1; i < length + 4; i++) {
+                crc = _crc8_ccitt_update(crc, received[i]);
+            }
+
+            bool matched = crc == received[length + 4] && received[1] == type && received[2] == sequence;
+
+            memcpy(framePayload, received + 4, length);
+            framePayload[length] = '\0';
+            consumeReceived(length + 5);
+
+            if (matched) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+void setUp() {}
+
+void tearDown() {}
+
+void test_start_reports_started() {
+    sendLine("START");
+
+    TEST_ASSERT_TRUE(waitForLine("STARTED"));
+    TEST_ASSERT_TRUE(waitForLine("OK"));
+}
+
+void test_unknown_command_is_rejected() {
+    TEST_ASSERT_EQUAL_STRING("ERROR", sendCommand("BOGUS 1"));
+}
+
+void test_keywords_match_whole_words() {
+    TEST_ASSERT_EQUAL_STRING("ERROR", sendCommand("LOG_LEVELS 1"));
+}
+
+void test_commands_are_case_insensitive() {
+    TEST_ASSERT_EQUAL_STRING("OK", sendCommand("log_level 1"));
+}
+
+void test_overlong_line_is_rejected() {
+    char command[300];
+    memset(command, 'A', sizeof(command) - 1);
+    command[sizeof(command) - 1] = '\0';
+
+    TEST_ASSERT_EQUAL_STRING("ERROR", sendCommand(command));
+}
+
+void test_sync_accepts_options() {
+    TEST_ASSERT_EQUAL_STRING("OK", sendCommand("SYNC FILAMENT_POSITIONS 170,148,126,104,80,56,32,10 EXTRUDE_MM 32 "
+                                               "RETRACT_MM 60 MM_PER_ROTATION 18.285714 MM_TO_STUCK 80 UNKNOWN 1"));
+}
+
+void test_midi_out_of_range_is_rejected() {
+    TEST_ASSERT_EQUAL_STRING("ERROR", sendCommand("MIDI 99"));
+}
+
+void test_filament_out_of_range_fails() {
+    TEST_ASSERT_TRUE(runOperation("FILAMENT 9"));
+    TEST_ASSERT_NOT_NULL(strstr(line, " ERROR "));
+}
+
+void test_swap_rejects_slots_out_of_range() {
+    TEST_ASSERT_EQUAL_STRING("ERROR", sendCommand("SWAP 12 1"));
+    TEST_ASSERT_EQUAL_STRING("ERROR", sendCommand("SWAP 0 8"));
+    TEST_ASSERT_EQUAL_STRING("ERROR", sendCommand("SWAP -2 1"));
+}
+
+void test_feed_rejects_invalid_arguments() {
+    TEST_ASSERT_EQUAL_STRING("ERROR", sendCommand("FEED 20 0"));
+    TEST_ASSERT_EQUAL_STRING("ERROR", sendCommand("FEED 20 -5"));
+    TEST_ASSERT_EQUAL_STRING("ERROR", sendCommand("FEED 0 2500"));
+}
+
+void test_feed_needs_filament_on_hub() {
+    TEST_ASSERT_EQUAL_STRING("ERROR", sendCommand("FEED 20 2500"));
+}
+
+void test_extrude_reaches_hub() {
+    TEST_ASSERT_TRUE(runOperation("FILAMENT 0"));
+    TEST_ASSERT_NOT_NULL(strstr(line, " OK "));
+
+    TEST_ASSERT_TRUE(runOperation("EXTRUDE 32 100"));
+    TEST_ASSERT_NOT_NULL(strstr(line, " OK "));
+    TEST_ASSERT_GREATER_THAN(TEST_HUB_STEPS, atol(strstr(line, "steps=") + 6));
+}
+
+void test_feed_runs_with_filament_on_hub() {
+    TEST_ASSERT_TRUE(runOperation("FEED 20 2500"));
+    TEST_ASSERT_NOT_NULL(strstr(line, " OK "));
+}
+
+void test_swap_away_from_empty_slot() {
+    setLoadedFilaments(0xFE);  // slot 0 ran out
+    runFor(100);
+
+    TEST_ASSERT_TRUE(runOperation("SWAP 0 1 60 100 32 100"));
+    TEST_ASSERT_NOT_NULL(strstr(line, " OK "));
+
+    setLoadedFilaments(0xFF);
+    runFor(100);
+}
+
+// Binary tests last, there is no way back to text mode short of the confirm timeout
+void test_binary_ping_answers() {
+    TEST_ASSERT_EQUAL_STRING("OK", sendCommand("BINARY 250000"));
+
+    sendFrame(FRAME_PING, 1, "");
+
+    TEST_ASSERT_TRUE(waitForFrame(FRAME_RESPONSE, 1));
+    TEST_ASSERT_EQUAL_STRING("OK", framePayload);
+}
+
+void test_binary_bad_crc_is_nacked() {
+    sendFrame(COMMAND_LOG_LEVEL, 2, "1", true);
+
+    TEST_ASSERT_TRUE(waitForFrame(FRAME_NAK, 2));
+}
+
+void test_binary_error_skips_queued_requests() {
+    sendFrame(COMMAND_SWAP | FRAME_ABORT_ON_ERROR, 3, "12 1");
+    sendFrame(COMMAND_LOG_LEVEL, 4, "1");
+
+    TEST_ASSERT_TRUE(waitForFrame(FRAME_RESPONSE, 3));
+    TEST_ASSERT_EQUAL_STRING("ERROR", framePayload);
+
+    TEST_ASSERT_TRUE(waitForFrame(FRAME_RESPONSE, 4));
+    TEST_ASSERT_EQUAL_STRING("ERROR SKIPPED", framePayload);
+}
+
+void test_binary_retransmit_repeats_response() {
+    sendFrame(COMMAND_SWAP | FRAME_ABORT_ON_ERROR, 3, "12 1");
+
+    TEST_ASSERT_TRUE(waitForFrame(FRAME_RESPONSE, 3));
+    TEST_ASSERT_EQUAL_STRING("ERROR", framePayload);
+}
+
+void test_binary_request_runs() {
+    sendFrame(COMMAND_LOG_LEVEL, 5, "1");
+
+    TEST_ASSERT_TRUE(waitForFrame(FRAME_RESPONSE, 5));
+    TEST_ASSERT_EQUAL_STRING("OK", framePayload);
+}
+
+void test_binary_half_frame_times_out() {
+    const uint8_t partial[] = {FRAME_START, COMMAND_LOG_LEVEL, 6};
+    write(serialInput, partial, sizeof(partial));
+    runFor(100);
+
+    sendFrame(FRAME_PING, 6, "");
+
+    TEST_ASSERT_TRUE(waitForFrame(FRAME_RESPONSE, 6));
+    TEST_ASSERT_EQUAL_STRING("OK", framePayload);
+}
+
+void test_binary_retransmit_while_queued_is_pending() {
+    sendFrame(COMMAND_START, 7, "");
+    sendFrame(COMMAND_START, 7, "");
+
+    TEST_ASSERT_TRUE(waitForFrame(FRAME_PENDING, 7));
+    TEST_ASSERT_TRUE(waitForFrame(FRAME_RESPONSE, 7));
+    TEST_ASSERT_EQUAL_STRING("OK", framePayload);
+}
+
+bool setupBoard() {
+    int input[2];
+    int output[2];
+
+    if (pipe(input) != 0 || pipe(output) != 0) {
+        return false;
+    }
+
+    fcntl(input[0], F_SETFL, O_NONBLOCK);
+    fcntl(output[0], F_SETFL, O_NONBLOCK);
+
+    inputFd = input[0];
+    serialInput = input[1];
+    outputFd = output[1];
+    serialOutput = output[0];
+
+    hubSteps = TEST_HUB_STEPS;
+    setLoadedFilaments(0xFF);
+    loadEeprom();
+
+    setup();
+    return waitForLine("READY");
+}
+
+int main(int argc, char** argv) {
+    if (!setupBoard()) {
+        return 1;
+    }
+
+    UNITY_BEGIN();
+
+    RUN_TEST(test_start_reports_started);
+    RUN_TEST(test_unknown_command_is_rejected);
+    RUN_TEST(test_keywords_match_whole_words);
+    RUN_TEST(test_commands_are_case_insensitive);
+    RUN_TEST(test_overlong_line_is_rejected);
+    RUN_TEST(test_sync_accepts_options);
+    RUN_TEST(test_midi_out_of_range_is_rejected);
+    RUN_TEST(test_filament_out_of_range_fails);
+    RUN_TEST(test_swap_rejects_slots_out_of_range);
+    RUN_TEST(test_feed_rejects_invalid_arguments);
+    RUN_TEST(test_feed_needs_filament_on_hub);
+    RUN_TEST(test_extrude_reaches_hub);
+    RUN_TEST(test_feed_runs_with_filament_on_hub);
+    RUN_TEST(test_swap_away_from_empty_slot);
+
+    RUN_TEST(test_binary_ping_answers);
+    RUN_TEST(test_binary_bad_crc_is_nacked);
+    RUN_TEST(test_binary_error_skips_queued_requests);
+    RUN_TEST(test_binary_retransmit_repeats_response);
+    RUN_TEST(test_binary_request_runs);
+    RUN_TEST(test_binary_half_frame_times_out);
+    RUN_TEST(test_binary_retransmit_while_queued_is_pending);
+
+    return UNITY_END();
+}
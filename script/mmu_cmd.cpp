@@ -0,0 +1,161 @@
+// Native mmu_cmd: same command line and exit codes as mmu_cmd.py (0 on OK, 1 on ERROR), without starting
+// a Python interpreter for every RUN_SHELL_COMMAND.
+//
+// Build a static binary with the printer toolchain, e.g.:
+//   mipsel-linux-gnu-g++ -std=c++11 -Os -static -o mmu_cmd mmu_cmd.cpp
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <string>
+
+#define SOCKET_PATH "/tmp/pico_mmu_service.sock"
+#define CONNECT_RETRY_SECONDS 1
+
+std::string trim(const std::string& text) {
+    size_t start = text.find_first_not_of(" \t\r\n");
+    if (start == std::string::npos) {
+        return "";
+    }
+
+    size_t end = text.find_last_not_of(" \t\r\n");
+    return text.substr(start, end - start + 1);
+}
+
+bool startsWith(const std::string& text, const char* prefix) {
+    return text.compare(0, strlen(prefix), prefix) == 0;
+}
+
+bool writeAll(int fd, const std::string& data) {
+    size_t sent = 0;
+
+    while (sent < data.size()) {
+        ssize_t length = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (length < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        sent += length;
+    }
+
+    return true;
+}
+
+int connectDaemon() {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, SOCKET_PATH, sizeof(address.sun_path) - 1);
+
+    if (connect(fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+
+    return fd;
+}
+
+// Tags the request with the PID and blocks in recv until its OK or ERROR line arrives
+int sendCommand(int fd, const std::string& command) {
+    std::string prefix = "#" + std::to_string(getpid()) + " ";
+
+    printf("[Socket] --> %s\n", command.c_str());
+    if (!writeAll(fd, prefix + command + "\n")) {
+        printf("Communication error: %s\n", strerror(errno));
+        return 1;
+    }
+
+    std::string buffer;
+    char chunk[1024];
+
+    while (true) {
+        ssize_t length = recv(fd, chunk, sizeof(chunk), 0);
+        if (length < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (length < 0) {
+            printf("Communication error: %s\n", strerror(errno));
+            return 1;
+        }
+
+        if (length == 0) {
+            printf("[Socket] Connection closed\n");
+            return 1;
+        }
+
+        buffer.append(chunk, length);
+
+        size_t end;
+        while ((end = buffer.find('\n')) != std::string::npos) {
+            std::string line = trim(buffer.substr(0, end));
+            buffer.erase(0, end + 1);
+
+            if (startsWith(line, prefix.c_str())) {
+                line.erase(0, prefix.size());
+            }
+
+            if (line.empty()) {
+                continue;
+            }
+
+            printf("[Socket] <-- %s\n", line.c_str());
+            if (startsWith(line, "OK")) {
+                return 0;
+            } else if (startsWith(line, "ERROR")) {
+                return 1;
+            }
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    // Klipper reads the output through a pipe, keep it line by line
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    if (argc < 2) {
+        printf("Usage: mmu_cmd <command>\n");
+        return 1;
+    }
+
+    std::string command;
+    for (int i = 1; i < argc; i++) {
+        if (i > 1) {
+            command += " ";
+        }
+        command += argv[i];
+    }
+    command = trim(command);
+
+    while (true) {
+        if (access(SOCKET_PATH, F_OK) != 0) {
+            printf("Socket not found: %s\n", SOCKET_PATH);
+            sleep(CONNECT_RETRY_SECONDS);
+            continue;
+        }
+
+        int fd = connectDaemon();
+        if (fd < 0) {
+            printf("Communication failed: %s\n", strerror(errno));
+            sleep(CONNECT_RETRY_SECONDS);
+            continue;
+        }
+
+        int result = sendCommand(fd, command);
+        close(fd);
+        return result;
+    }
+}
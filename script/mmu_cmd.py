@@ -6,10 +6,13 @@ import time
 
 SOCKET_PATH = "/tmp/pico_mmu_service.sock"
 
+# O ID do pedido é o PID; o daemon devolve cada linha com o mesmo prefixo
 def send_command(sock, command: str) -> str:
+    prefix = f"#{os.getpid()} "
+
     try:
         print(f"[Socket] --> {command}")
-        sock.sendall((command + "\n").encode())
+        sock.sendall((prefix + command + "\n").encode())
 
         buffer = ""
         while True:
@@ -22,15 +25,16 @@ def send_command(sock, command: str) -> str:
             while "\n" in buffer:
                 line, buffer = buffer.split("\n", 1)
                 line = line.strip()
+                if line.startswith(prefix):
+                    line = line[len(prefix):]
+
                 if line:
                     print(f"[Socket] <-- {line}")
                     if line.startswith("OK"):
                         return "OK"
                     elif line.startswith("ERROR"):
                         return "ERROR"
-                    
-            time.sleep(0.1)
-                    
+
     except (BrokenPipeError, ConnectionResetError) as e:
         print(f"Communication error: {e}")
         return "ERROR"
@@ -1,11 +1,11 @@
 #!/usr/bin/env python3
+import asyncio
 import glob
 import http.client
 import json
 import logging
 import os
-import queue
-import socket
+import struct
 import sys
 import threading
 import time
@@ -18,24 +18,98 @@ SOCKET_PATH = "/tmp/pico_mmu_service.sock"
 BAUDRATE = 9600
 RESPONSE_TERMINATORS = ("OK", "ERROR")
 
+# Protocolo binário (MMU_PROTOCOL=text mantém as linhas de texto para depuração manual)
+BINARY_PROTOCOL = os.environ.get("MMU_PROTOCOL", "binary").lower() != "text"
+BINARY_BAUDRATE = 250000
+BINARY_CONFIRM_TIMEOUT_SECONDS = 2
+
+FRAME_START = 0xA5
+FRAME_PING = 0x40
+FRAME_LOG = 0x80
+FRAME_RESPONSE = 0x81
+FRAME_EVENT = 0x82
+FRAME_NAK = 0x83
+FRAME_PENDING = 0x84
+FRAME_RETRY_SECONDS = 1
+FRAME_MAX_RETRIES = 3
+
+# Frames enviados antes das respostas. O firmware enfileira COMMAND_QUEUE_SIZE (4), um a mais porque
+# os comandos de movimento respondem antes de terminar; payloads maiores que a fila (SYNC) vão sozinhos.
+FRAME_PIPELINE_DEPTH = 3
+FRAME_QUEUE_PAYLOAD_SIZE = 31
+FRAME_ABORT_ON_ERROR = 0x20
+
+# "!<comando>": um ERROR descarta os comandos já enfileirados no firmware atrás dele ("ERROR SKIPPED")
+ABORT_ON_ERROR_PREFIX = "!"
+
+# Comandos de movimento respondem "OK OP=<id>" ao serem aceitos e terminam com "DONE <id> OK|ERROR steps=.. mm=..".
+# O cliente recebe a resposta depois do DONE; com "&<comando>" recebe já o OK OP= e espera depois com "wait_op [id]".
+ACCEPT_ONLY_PREFIX = "&"
+OPERATION_HISTORY = 32
+
+# Mesma ordem do enum CommandId do firmware
+COMMAND_OPCODES = {
+    "START": 0,
+    "SYNC": 1,
+    "FILAMENT_RELEASE": 2,
+    "FILAMENT": 3,
+    "EXTRUDE": 4,
+    "RETRACT": 5,
+    "SWAP_FINISH": 6,
+    "CUTTER_POSITION": 7,
+    "MMU_POSITION": 8,
+    "MMU_ROTATE": 9,
+    "MIDI": 10,
+    "TEST_LEDS": 11,
+    "TEST_LED": 12,
+    "BINARY": 13,
+    "LOG_DUMP": 14,
+    "LOG_LEVEL": 15,
+    "STATS": 16,
+    "STATS_RESET": 17,
+    "CALIBRATE": 18,
+    "SWAP": 19,
+    "FEED": 20,
+}
+
+# Gerado a partir de include/log_events.h no build do firmware
+LOG_EVENTS_FILE = os.path.join(os.path.dirname(os.path.abspath(__file__)), "log_events.json")
+LOG_RECORD = struct.Struct("<IBBBii")
+LOG_LEVEL_NAMES = ("DEBUG", "INFO", "WARN", "ERROR")
+LOG_DUMP_INTERVAL_SECONDS = 2
+
+METRICS_FILE = "/tmp/mmu_metrics.json"
+STATS_INTERVAL_SECONDS = 60
+
 FILAMENT_FILE = "/var/lib/filament.txt"
+CALIBRATION_FILE = "/var/lib/mmu_calibration.json"
 
 KLIPPER_HOST = "127.0.0.1"
 KLIPPER_PORT = 7125
 
 ARDUINO_ALIVE_TIMEOUT_SECONDS = 30
 
+# "#<id> <comando>": todas as linhas da resposta voltam com o mesmo prefixo
+REQUEST_ID_PREFIX = "#"
+
 # Variáveis globais
-arduino_started = False
-arduino_synced = False
+arduino_config_hash = None
 arduino_last_alive = time.time()
 
 sync_command = ""
 
 serial_port = None
-serial_reader_paused = threading.Event()
-command_queue = queue.Queue()
-output_conn = None
+binary_mode = False
+frame_sequence = 0
+log_events = []
+last_stats_scrape = 0
+text_buffer = bytearray()
+pending_requests = {}  # sequência -> Request, na ordem de envio; 0 para a linha de texto
+operations = {}  # ID -> Operation, na ordem de aceitação; as concluídas ficam para wait_op
+outgoing_requests = None
+window_open = None
+arduino_ready = None
+command_queue = None
 running = True
 
 # Logging
@@ -50,6 +124,113 @@ console_handler = logging.StreamHandler(sys.stdout)
 console_handler.setFormatter(logging.Formatter('%(asctime)s %(levelname)s: %(message)s'))
 logger.addHandler(console_handler)
 
+def crc8(data: bytes) -> int:
+    crc = 0
+    for value in data:
+        crc ^= value
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x07) & 0xFF if crc & 0x80 else (crc << 1) & 0xFF
+    return crc
+
+# Mesmo CRC-16 do firmware (_crc16_update), sobre os argumentos do SYNC sem espaços
+def sync_hash(command: str) -> int:
+    words = command.split(None, 1)
+    data = "".join(words[1].split()).upper().encode() if len(words) > 1 else b""
+
+    crc = 0xFFFF
+    for value in data:
+        crc ^= value
+        for _ in range(8):
+            crc = (crc >> 1) ^ 0xA001 if crc & 1 else crc >> 1
+    return crc
+
+# "READY CONFIG=1A2B" / "STARTED CONFIG=1A2B": hash da config salva na EEPROM do firmware
+def parse_config_hash(line: str):
+    global arduino_config_hash
+
+    for word in line.split():
+        if word.startswith("CONFIG="):
+            try:
+                arduino_config_hash = int(word[len("CONFIG="):], 16)
+                logger.info(f"Firmware config hash: {arduino_config_hash:04X}")
+            except ValueError:
+                pass
+
+def encode_frame(frame_type: int, sequence: int, payload: bytes) -> bytes:
+    body = bytes([frame_type, sequence, len(payload)]) + payload
+    return bytes([FRAME_START]) + body + bytes([crc8(body)])
+
+def next_frame_sequence() -> int:
+    global frame_sequence
+
+    frame_sequence = frame_sequence % 255 + 1  # 0 fica reservado para comandos de texto
+    return frame_sequence
+
+class FrameReader:
+    def __init__(self):
+        self.buffer = bytearray()
+
+    def reset(self):
+        self.buffer.clear()
+
+    # Retorna (tipo, sequência, payload) por frame completo; tipo None para frame corrompido
+    def feed(self, data: bytes):
+        self.buffer.extend(data)
+        frames = []
+
+        while True:
+            start = self.buffer.find(FRAME_START)
+            if start < 0:
+                self.buffer.clear()
+                break
+
+            del self.buffer[:start]
+            if len(self.buffer) < 4:
+                break
+
+            end = 4 + self.buffer[3] + 1
+            if len(self.buffer) < end:
+                break
+
+            body = bytes(self.buffer[1:end - 1])
+            if crc8(body) != self.buffer[end - 1]:
+                frames.append((None, 0, b""))
+                del self.buffer[:1]
+                continue
+
+            frames.append((body[0], body[1], body[3:]))
+            del self.buffer[:end]
+
+        return frames
+
+frame_reader = FrameReader()
+
+def load_log_events():
+    global log_events
+
+    try:
+        with open(LOG_EVENTS_FILE, "r") as f:
+            log_events = [event["message"] for event in json.load(f)["events"]]
+    except Exception as e:
+        logger.warning(f"Failed to load log events, dumps will show raw IDs: {e}")
+
+def decode_log_records(payload: bytes):
+    lines = []
+    for offset in range(0, len(payload) - LOG_RECORD.size + 1, LOG_RECORD.size):
+        timestamp, event, level, argument_count, first, second = LOG_RECORD.unpack_from(payload, offset)
+
+        message = log_events[event] if event < len(log_events) else f"Event #{event} "
+        arguments = [first, second][:argument_count]
+        level_name = LOG_LEVEL_NAMES[level] if level < len(LOG_LEVEL_NAMES) else str(level)
+
+        lines.append(f"[{timestamp}] {level_name} - {message}" + " ".join(str(argument) for argument in arguments))
+    return lines
+
+def frame_lines(frame_type: int, payload: bytes):
+    if frame_type == FRAME_LOG:
+        return decode_log_records(payload)
+    return [payload.decode(errors="ignore")]
+
 def read_filament_file():
     try:
         with open(FILAMENT_FILE, "r") as f:
@@ -79,7 +260,6 @@ def notify_filament_klipper(filament):
 
 def monitor_printer_status():
     global running
-    global arduino_synced
 
     last_state = None
 
@@ -99,7 +279,6 @@ def monitor_printer_status():
                     logger.info(f"Printer state changed: {last_state} -> {state}")
 
                     if state == "ready":
-                        arduino_synced = False
                         filament = read_filament_file()
                         if filament:
                             notify_filament_klipper(filament)
@@ -115,282 +294,747 @@ def monitor_printer_status():
 
         time.sleep(10)
 
-def monitor_arduino_status():
-    global arduino_started
-    global arduino_last_alive
-    global running
+# Um pedido para o firmware; o leitor serial completa o future quando chega a resposta
+class Request:
+    def __init__(self, description, client, line_handler, frame_type=None, payload=b""):
+        self.description = description
+        self.client = client
+        self.line_handler = line_handler
+        self.frame_type = frame_type  # None para linha de texto
+        self.payload = payload
+        self.sequence = 0
+        self.frame = None
+        self.future = asyncio.get_event_loop().create_future()
+        self.sent_at = None
+        self.retries = 0
+        self.last_activity = time.time()
+
+    # Linhas de texto e payloads que não cabem na fila do firmware não dividem a serial
+    def is_exclusive(self):
+        return self.frame_type is None or len(self.payload) > FRAME_QUEUE_PAYLOAD_SIZE
+
+    def complete(self, response):
+        if pending_requests.get(self.sequence) is self:
+            del pending_requests[self.sequence]
+            window_open.set()
+
+        if not self.future.done():
+            self.future.set_result(response)
+
+    # Reenvia com a mesma sequência para o firmware repetir a resposta sem executar o comando de novo
+    def resend(self):
+        if self.retries >= FRAME_MAX_RETRIES:
+            logger.error(f"[Arduino] #{self.sequence} gave up after {FRAME_MAX_RETRIES} retries")
+            self.complete(None)
+            return
+
+        self.retries += 1
+        self.last_activity = time.time()
+        logger.info(f"[Arduino] --> #{self.sequence} retry {self.retries}")
+        write_serial(self.frame)
+
+# Comando de movimento aceito pelo firmware; o leitor completa o future com a linha DONE
+class Operation:
+    def __init__(self, operation_id, request):
+        self.operation_id = operation_id
+        self.description = request.description
+        self.client = request.client
+        self.line_handler = request.line_handler
+        self.future = asyncio.get_event_loop().create_future()
+
+    def complete(self, line):
+        if not self.future.done():
+            self.future.set_result(line)
+
+def parse_operation_id(response: str):
+    for word in response.split()[1:]:
+        if word.startswith("OP="):
+            try:
+                return int(word[len("OP="):])
+            except ValueError:
+                return None
+    return None
+
+# O firmware reusa os IDs depois de 255; só as últimas OPERATION_HISTORY concluídas ficam guardadas
+def register_operation(response: str, request: Request):
+    operation_id = parse_operation_id(response)
+    if operation_id is None:
+        return
+
+    operations.pop(operation_id, None)
+    operations[operation_id] = Operation(operation_id, request)
+
+    finished = [key for key, operation in operations.items() if operation.future.done()]
+    for key in finished[:max(0, len(operations) - OPERATION_HISTORY)]:
+        del operations[key]
+
+def complete_operation(line: str) -> bool:
+    words = line.split()
+    try:
+        operation = operations.get(int(words[1]))
+    except (IndexError, ValueError):
+        return False
+
+    if operation is None:
+        return False
+
+    operation.complete(line)
+    return True
+
+# O firmware executa um comando por vez: a operação aceita por último e ainda aberta é a que está rodando
+def running_operation():
+    for operation in reversed(list(operations.values())):
+        if not operation.future.done():
+            return operation
+    return None
+
+# Conexão e ID de um pedido de cliente; vários clientes podem ter pedidos na fila ao mesmo tempo
+class ClientRequest:
+    def __init__(self, writer, request_id):
+        self.writer = writer
+        self.request_id = request_id
+
+def parse_client_line(line: str):
+    if line.startswith(REQUEST_ID_PREFIX):
+        request_id, _, command = line.partition(" ")
+        return request_id[len(REQUEST_ID_PREFIX):], command.strip()
+    return None, line
+
+def forward_to_client(client, line: str):
+    if client is None or client.writer.is_closing():
+        return
+
+    if client.request_id is not None:
+        line = f"{REQUEST_ID_PREFIX}{client.request_id} {line}"
+
+    try:
+        logger.info(f"[Socket] --> {line}")
+        client.writer.write((line + "\n").encode())
+    except Exception as e:
+        logger.warning(f"Socket write error: {e}")
+
+def close_serial_port():
     global serial_port
+    global binary_mode
 
-    while running:
-        if arduino_started:
-            if time.time() - arduino_last_alive > ARDUINO_ALIVE_TIMEOUT_SECONDS:
-                logger.warning("Arduino is not alive. Restarting connection...")
-                arduino_started = False
+    arduino_ready.clear()
 
-                try:
-                    serial_port.close()
-                except Exception:
-                    pass
-                serial_port = None
+    if serial_port:
+        try:
+            asyncio.get_event_loop().remove_reader(serial_port.fileno())
+            serial_port.close()
+        except Exception:
+            pass
+    serial_port = None
+    binary_mode = False
 
-        time.sleep(1)
+    for request in list(pending_requests.values()):
+        request.complete(None)
+    for operation in operations.values():
+        operation.complete(None)
+    window_open.set()
 
-def scan_serial_ports():
+def open_serial_port(dev: str):
     global serial_port
-    global arduino_started
-    global arduino_synced
-    global running
-    global sync_command
-    
-    logger.info("[Thread] scan_serial_ports started")
+    global binary_mode
+
+    # timeout=0: o loop só lê quando o descritor avisa que há bytes
+    port = serial.Serial(dev, BAUDRATE, timeout=0)
+    serial_port = port
+    binary_mode = False
+    frame_reader.reset()
+    text_buffer.clear()
+
+    asyncio.get_event_loop().add_reader(port.fileno(), on_serial_readable)
+    logger.info(f"Connected to serial device: {dev}")
+
+def write_serial(data: bytes) -> bool:
+    try:
+        serial_port.write(data)
+        serial_port.flush()
+        return True
+    except Exception as e:
+        logger.error(f"Error while writing to serial: {e}")
+        close_serial_port()
+        return False
+
+# Único leitor da serial: linhas e frames vão para o comando em andamento ou para o log
+def on_serial_readable():
+    global arduino_last_alive
+
+    try:
+        data = serial_port.read(serial_port.in_waiting or 1)
+    except Exception as e:
+        logger.error(f"Serial read error: {e}")
+        close_serial_port()
+        return
+
+    if not data:
+        return
+    arduino_last_alive = time.time()
+
+    if binary_mode:
+        for frame_type, sequence, payload in frame_reader.feed(data):
+            handle_frame(frame_type, sequence, payload)
+        return
+
+    text_buffer.extend(data)
+    while True:
+        end = text_buffer.find(b"\n")
+        if end < 0:
+            break
+
+        line = text_buffer[:end].decode(errors="ignore").strip()
+        del text_buffer[:end + 1]
+        if line:
+            handle_text_line(line)
+
+# Linhas que não são resposta vão para a operação em andamento ou, sem ela, para o pedido pendente;
+# o DONE só completa a operação, quem espera por ela repassa a linha
+def route_event(line: str, request):
+    if line.startswith("DONE ") and complete_operation(line):
+        return
+
+    target = running_operation() or request
+    if target is None:
+        return
+
+    if target.line_handler:
+        target.line_handler(line)
+    forward_to_client(target.client, line)
+
+def handle_text_line(line: str):
+    logger.info(f"[Arduino] <-- {line}")
+    parse_config_hash(line)
+
+    request = pending_requests.get(0)
+    if request and any(line.startswith(term) for term in RESPONSE_TERMINATORS):
+        register_operation(line, request)
+        request.complete(line)
+        return
+
+    route_event(line, request)
+
+def handle_frame(frame_type, sequence: int, payload: bytes):
+    if frame_type is None:
+        logger.warning("[Arduino] <-- corrupted frame")
+        return
+
+    request = pending_requests.get(sequence) if sequence else None
+    if request:
+        if frame_type == FRAME_NAK:
+            logger.warning(f"[Arduino] <-- NAK #{sequence}")
+            request.resend()
+            return
+
+        # O reenvio chegou enquanto o pedido ainda está na fila do firmware: a resposta vem quando ele rodar
+        if frame_type == FRAME_PENDING:
+            logger.info(f"[Arduino] <-- #{sequence} pending")
+            request.retries = 0
+            request.last_activity = time.time()
+            return
+
+        if frame_type == FRAME_RESPONSE:
+            text = payload.decode(errors="ignore")
+            logger.info(f"[Arduino] <-- #{sequence} {text}")
+            register_operation(text, request)
+            request.complete(text)
+            return
+
+    # Resposta repetida de um pedido já concluído (reenvio que cruzou com a resposta)
+    if frame_type in (FRAME_RESPONSE, FRAME_NAK, FRAME_PENDING):
+        logger.info(f"[Arduino] <-- #{sequence} late answer ignored")
+        return
+
+    # Sem operação em andamento, eventos saem do pedido pendente mais antigo
+    request = next(iter(pending_requests.values()), None)
+
+    for line in frame_lines(frame_type, payload):
+        logger.info(f"[Arduino] <-- {line}")
+        parse_config_hash(line)
+        route_event(line, request)
+
+def window_allows(request: Request) -> bool:
+    if not pending_requests:
+        return True
+
+    if request.is_exclusive() or any(pending.is_exclusive() for pending in pending_requests.values()):
+        return False
+
+    return len(pending_requests) < FRAME_PIPELINE_DEPTH
+
+def transmit(request: Request):
+    if request.frame_type is None:
+        logger.info(f"[Arduino] --> {request.description}")
+        data = (request.description + "\n").encode()
+    else:
+        request.sequence = next_frame_sequence()
+        request.frame = encode_frame(request.frame_type, request.sequence, request.payload)
+        logger.info(f"[Arduino] --> #{request.sequence} {request.description}")
+        data = request.frame
+
+    pending_requests[request.sequence] = request
+    request.sent_at = time.time()
+    request.last_activity = request.sent_at
+    write_serial(data)
+
+# Único escritor da serial: envia na ordem de chegada, com até FRAME_PIPELINE_DEPTH frames sem resposta
+async def write_requests():
+    logger.info("[Task] write_requests started")
     while running:
-        if serial_port is None or not serial_port.is_open:
-            arduino_started = False
+        request = await outgoing_requests.get()
+
+        while serial_port is not None and not window_allows(request):
+            window_open.clear()
+            await window_open.wait()
+
+        if serial_port is None:
+            request.complete(None)
+        else:
+            transmit(request)
+
+# Espera o leitor completar o pedido. Um frame sem RESPONSE/NAK/PENDING em FRAME_RETRY_SECONDS é reenviado:
+# um byte perdido no fio deixaria o pedido sem resposta para sempre. O firmware repete a resposta de uma
+# sequência já atendida, então reenviar nunca executa o comando duas vezes.
+async def wait_response(request: Request, timeout=None):
+    outgoing_requests.put_nowait(request)
+
+    while True:
+        try:
+            return await asyncio.wait_for(asyncio.shield(request.future), FRAME_RETRY_SECONDS)
+        except asyncio.TimeoutError:
+            pass
+
+        if request.sent_at is None:
+            continue
+
+        if timeout is not None and time.time() - request.sent_at > timeout:
+            request.complete(None)
+            return None
+
+        if request.frame is not None and time.time() - request.last_activity > FRAME_RETRY_SECONDS:
+            request.resend()
+
+def build_request(command: str, client, line_handler):
+    abort_on_error = command.startswith(ABORT_ON_ERROR_PREFIX)
+    if abort_on_error:
+        command = command[len(ABORT_ON_ERROR_PREFIX):].strip()
+
+    if not binary_mode:
+        return Request(command, client, line_handler)
+
+    words = command.split(None, 1)
+    opcode = COMMAND_OPCODES.get(words[0].upper()) if words else None
+
+    if opcode is None:
+        logger.warning(f"Command not supported by the binary protocol: {command}")
+        return None
+
+    if abort_on_error:
+        opcode |= FRAME_ABORT_ON_ERROR
+
+    payload = words[1].encode() if len(words) > 1 else b""
+    return Request(command, client, line_handler, opcode, payload)
+
+# Espera o DONE da operação e repassa a linha; devolve OK ou ERROR como uma resposta comum
+async def wait_operation(operation_id: int, client) -> str:
+    operation = operations.get(operation_id)
+    line = await asyncio.shield(operation.future) if operation else None
+
+    if line is None:
+        return "ERROR"
+
+    forward_to_client(client, line)
+    words = line.split()
+    return "OK" if len(words) > 2 and words[2] == "OK" else "ERROR"
+
+# A resposta vai para o cliente só depois do DONE, a não ser com accept_only
+async def send_command(command: str, client=None, line_handler=None, accept_only=False) -> str:
+    request = build_request(command, client, line_handler) if serial_port else None
+    response = await wait_response(request) if request else None
+
+    if response is None:
+        response = "ERROR"
+
+    operation_id = parse_operation_id(response)
+    if operation_id is not None and not accept_only:
+        response = await wait_operation(operation_id, client)
 
+    forward_to_client(client, response)
+    return response
+
+# "STATS LOOP n=1 avg_us=2" -> {"loop": {"n": 1, "avg_us": 2}}, comandos ficam em "cmd" pelo nome
+def parse_stats_line(line: str, metrics: dict):
+    words = line.split()
+    if len(words) < 2 or words[0] != "STATS":
+        return
+
+    group = words[1].lower()
+    fields = words[2:]
+    target = metrics.setdefault(group, {})
+
+    if group == "cmd" and fields:
+        target = target.setdefault(fields[0], {})
+        fields = fields[1:]
+
+    for field in fields:
+        name, _, value = field.partition("=")
+        try:
+            target[name] = int(value)
+        except ValueError:
+            target[name] = value
+
+async def scrape_stats():
+    metrics = {}
+    response = await send_command("stats", line_handler=lambda line: parse_stats_line(line, metrics))
+
+    if response != "OK" or not metrics:
+        logger.warning("Failed to scrape firmware stats")
+        return
+
+    metrics["timestamp"] = time.time()
+    try:
+        with open(METRICS_FILE + ".tmp", "w") as f:
+            json.dump(metrics, f)
+        os.replace(METRICS_FILE + ".tmp", METRICS_FILE)
+    except Exception as e:
+        logger.error(f"Failed to write metrics file: {e}")
+
+# "CALIBRATION T3 hyst_um=812 sd_um=40 ..." -> {"T3": {"hyst_um": 812, "sd_um": 40, ...}}
+def parse_calibration_line(line: str, results: dict):
+    words = line.split()
+    if len(words) < 2 or words[0] != "CALIBRATION":
+        return
+
+    target = results.setdefault(words[1], {})
+    for field in words[2:]:
+        name, _, value = field.partition("=")
+        try:
+            target[name] = int(value)
+        except ValueError:
+            target[name] = value
+
+# Guarda o resultado por slot, mantendo as medições dos outros slots
+async def run_calibration(command: str, client):
+    results = {}
+    response = await send_command(command, client, lambda line: parse_calibration_line(line, results))
+
+    if response != "OK" or not results:
+        logger.warning("Calibration failed")
+        return
+
+    calibration = {}
+    try:
+        if os.path.exists(CALIBRATION_FILE):
+            with open(CALIBRATION_FILE, "r") as f:
+                calibration = json.load(f)
+    except Exception as e:
+        logger.warning(f"Ignoring unreadable calibration file: {e}")
+
+    for slot, values in results.items():
+        values["timestamp"] = time.time()
+        calibration[slot] = values
+        logger.info(f"Calibration {slot}: {values}")
+
+    try:
+        with open(CALIBRATION_FILE + ".tmp", "w") as f:
+            json.dump(calibration, f, indent=2)
+        os.replace(CALIBRATION_FILE + ".tmp", CALIBRATION_FILE)
+    except Exception as e:
+        logger.error(f"Failed to write calibration file: {e}")
+
+async def negotiate_binary_protocol():
+    global binary_mode
+
+    binary_mode = False
+    if not BINARY_PROTOCOL:
+        return
+
+    response = await send_command(f"binary {BINARY_BAUDRATE}")
+    if response != "OK" or serial_port is None:
+        logger.warning("Binary protocol refused, staying on text protocol")
+        return
+
+    # Nada mais é enviado até arduino_ready, a troca de baud rate não disputa a serial
+    serial_port.baudrate = BINARY_BAUDRATE
+    serial_port.reset_input_buffer()
+    frame_reader.reset()
+    binary_mode = True
+
+    response = await wait_response(Request("ping", None, None, FRAME_PING), BINARY_CONFIRM_TIMEOUT_SECONDS)
+    if response == "OK":
+        logger.info(f"Binary protocol active at {BINARY_BAUDRATE} baud")
+    elif serial_port:
+        binary_mode = False
+        logger.warning("No binary response, falling back to text protocol")
+        serial_port.baudrate = BAUDRATE
+        await asyncio.sleep(BINARY_CONFIRM_TIMEOUT_SECONDS)  # o firmware volta para texto sozinho
+        serial_port.reset_input_buffer()
+        text_buffer.clear()
+
+async def start_arduino():
+    global arduino_config_hash
+
+    await asyncio.sleep(5)
+    await negotiate_binary_protocol()
+
+    if await send_command('start') != 'OK':
+        logger.warning("Firmware did not start, retrying connection")
+        close_serial_port()
+        return
+
+    # A config persistida na EEPROM só é reenviada se mudou
+    if sync_command != "" and sync_hash(sync_command) != arduino_config_hash:
+        if await send_command(sync_command) == "OK":
+            arduino_config_hash = sync_hash(sync_command)
+
+    filament = read_filament_file()
+    if filament:
+        await send_command(f'filament {filament}')
+        await send_command('filament_release')
+
+    if serial_port:
+        arduino_ready.set()
+
+async def scan_serial_ports():
+    logger.info("[Task] scan_serial_ports started")
+    while running:
+        if serial_port is None:
             candidates = glob.glob('/dev/ttyUSB*') + glob.glob('/dev/ttyACM*')
             for dev in candidates:
-                try:              
-                    port = serial.Serial(dev, BAUDRATE)
-                    serial_port = port
-                    logger.info(f"Connected to serial device: {dev}")
-                    
-                    time.sleep(5)
-
-                    command = 'start'
-                    response = send_command(command, False, False)
-
-                    if response == 'OK':
-                        if sync_command != "":
-                            send_command(sync_command, False, False)
-                        else:
-                            arduino_synced = False
-
-                        filament = read_filament_file()
-                        if filament:
-                            command = f'filament {filament}'
-                            send_command(command, False, False)
-
-                            command = 'filament_release'
-                            send_command(command, False, False)
-                        
-                        arduino_started = True
-                    break
+                try:
+                    open_serial_port(dev)
                 except Exception as e:
                     logger.warning(f"Failed to open {dev}: {e}")
-        time.sleep(10)
+                    continue
 
-def read_serial_background():
-    global serial_port
-    global serial_reader_paused
-    global running
-    global arduino_last_alive
-    global arduino_started
+                try:
+                    await start_arduino()
+                except Exception as e:
+                    logger.error(f"Failed to start {dev}: {e}")
+                    close_serial_port()
+                break
+        await asyncio.sleep(10)
 
-    logger.info("[Thread] read_serial_background started")
-    buffer = ""
+async def monitor_arduino_status():
     while running:
-        if serial_port and serial_port.is_open and not serial_reader_paused.is_set():
-            try:
-                if serial_port.in_waiting:
-                    line = serial_port.readline().decode(errors="ignore").strip()
-                    if line:
-                        logger.info(f"[Arduino] <-- {line}")
-                        arduino_last_alive = time.time()
-
-            except Exception as e:
-                logger.error(f"Serial read error: {e}")
-
-                if "Input/output error" in str(e):
-                    arduino_started = False
-                    
-                    try:
-                        serial_port.close()
-                    except Exception:
-                        pass
-                    serial_port = None
-        time.sleep(0.1)
-
-def process_command_queue():
-    global serial_port
-    global arduino_started
-    global arduino_synced
-    global command_queue
-    global output_conn
-    global running
-    global sync_command
+        if arduino_ready.is_set() and time.time() - arduino_last_alive > ARDUINO_ALIVE_TIMEOUT_SECONDS:
+            logger.warning("Arduino is not alive. Restarting connection...")
+            close_serial_port()
 
-    logger.info("[Thread] process_command_queue started")
-    while running:
-        try:
-            command = command_queue.queue[0] if command_queue.qsize() > 0 else None
-
-            if command and serial_port and serial_port.is_open and arduino_started:
-                if command.lower().startswith("sync"):
-                    if not arduino_synced:
-                        sync_command = command
-                        send_command(command, True, True)
-                        arduino_synced = True
-                    else:
-                        send_socket("OK")
-                        remove_command_from_queue()
-                        
-
-                elif command.lower().startswith("filament "):
-                    filament_value = command[len("filament "):].strip()
-                    with open(FILAMENT_FILE, "w") as f:
-                        f.write(filament_value)
-                    
-                    send_command(command, True, True)
-
-                elif command.lower() == "filament_reengage":
-                    if not os.path.exists(FILAMENT_FILE):
-                        logger.warning("No filament stored to reengage.")
-
-                        send_socket("ERROR")
-                        remove_command_from_queue()
-
-                    else:
-                        with open(FILAMENT_FILE, "r") as f:
-                            filament_value = f.read().strip()
-
-                            if not filament_value:
-                                logger.warning("Stored filament value is empty.")
-                                send_socket("ERROR")
-                                remove_command_from_queue()
-
-                            else:
-                                send_command(f"filament {filament_value}", True, True)
-                
-                else:
-                    send_command(command, True, True)
+        await asyncio.sleep(1)
 
-        except Exception as e:
-            logger.error(f"Error while processing command queue: {e}")
-        
-        time.sleep(0.1)
+# Os logs ficam no buffer do firmware; busca quando não há comando nem operação em andamento.
+# O firmware também os envia antes de cada resposta e de cada DONE, e "STATS LOG dropped=" conta os perdidos
+async def poll_firmware():
+    global last_stats_scrape
 
-def remove_command_from_queue():
-    global command_queue
+    logger.info("[Task] poll_firmware started")
+    while running:
+        await asyncio.sleep(LOG_DUMP_INTERVAL_SECONDS)
 
-    if command_queue.qsize() > 0:
-        command_queue.get()
+        if not arduino_ready.is_set() or not command_queue.empty() or pending_requests or not outgoing_requests.empty():
+            continue
+        if running_operation():
+            continue
 
-def send_socket(response: str):
-    global output_conn
+        await send_command("log_dump")
 
-    if output_conn:
-        try:
-            logger.info(f"[Socket] --> {response}")
-            output_conn.sendall((response + "\n").encode())
-        except Exception as e:
-            logger.warning(f"Socket write error: {e}")
+        if time.time() - last_stats_scrape > STATS_INTERVAL_SECONDS:
+            await scrape_stats()
+            last_stats_scrape = time.time()
 
-def send_command(command: str, send_socket: bool, remove_from_queue: bool) -> str:
-    global serial_port
-    global serial_reader_paused
-    global output_conn
-    global running
-    global arduino_last_alive
-    global arduino_started
-    
+async def process_command(command: str, client):
+    global arduino_config_hash
+    global sync_command
+
+    accept_only = command.startswith(ACCEPT_ONLY_PREFIX)
+    if accept_only:
+        command = command[len(ACCEPT_ONLY_PREFIX):].strip()
+
+    if command.lower().startswith("sync"):
+        sync_command = command
+        if sync_hash(command) != arduino_config_hash:
+            if await send_command(command, client) == "OK":
+                arduino_config_hash = sync_hash(command)
+        else:
+            forward_to_client(client, "OK")
+
+    elif command.lower().startswith("filament "):
+        filament_value = command[len("filament "):].strip()
+        with open(FILAMENT_FILE, "w") as f:
+            f.write(filament_value)
+
+        await send_command(command, client, accept_only=accept_only)
+
+    elif command.lower() == "filament_reengage":
+        filament_value = ""
+        if os.path.exists(FILAMENT_FILE):
+            with open(FILAMENT_FILE, "r") as f:
+                filament_value = f.read().strip()
+
+        if not filament_value:
+            logger.warning("No filament stored to reengage.")
+            forward_to_client(client, "ERROR")
+        else:
+            await send_command(f"filament {filament_value}", client, accept_only=accept_only)
+
+    elif command.lower().startswith("calibrate"):
+        await run_calibration(command, client)
+
+    # "swap <de> <para> ...": o slot novo só é gravado depois que a troca inteira deu certo,
+    # também com "&swap", quando o cliente já recebeu o OK OP=
+    elif command.lower().startswith("swap "):
+        words = command.split()
+        response = await send_command(command, client, accept_only=accept_only)
+
+        operation_id = parse_operation_id(response)
+        if operation_id is not None:
+            response = await wait_operation(operation_id, None)
+
+        if response == "OK" and len(words) > 2:
+            with open(FILAMENT_FILE, "w") as f:
+                f.write(words[2])
+
+    else:
+        await send_command(command, client, accept_only=accept_only)
+
+async def run_client_command(command: str, client):
     try:
-        serial_reader_paused.set()
+        await process_command(command, client)
+    except Exception as e:
+        logger.error(f"Error while processing command queue: {e}")
+        forward_to_client(client, "ERROR")
 
-        logger.info(f"[Arduino] --> {command}")
-        serial_port.write((command + "\n").encode())
-        serial_port.flush()
-        logger.info(f"Flushed")
+# Não espera a resposta: cada comando vira uma task que entra na fila de envio na ordem da fila,
+# e write_requests mantém até FRAME_PIPELINE_DEPTH deles no firmware
+async def process_command_queue():
+    logger.info("[Task] process_command_queue started")
+    while running:
+        command, client = await command_queue.get()
+        await arduino_ready.wait()
 
-        while running:
-            if serial_port.in_waiting:
-                line = serial_port.readline().decode(errors="ignore").strip()
-                if line:
-                    logger.info(f"[Arduino] <-- {line}")
-                    arduino_last_alive = time.time()
-
-                    if output_conn and send_socket:
-                        try:
-                            logger.info(f"[Socket] --> {line}")
-                            output_conn.sendall((line + "\n").encode())
-                        except Exception as e:
-                            logger.warning(f"Socket write error: {e}")
-                    if any(line.startswith(term) for term in RESPONSE_TERMINATORS):
-                        if remove_from_queue:
-                            remove_command_from_queue()
-
-                        return line
-            time.sleep(0.1)
+        asyncio.ensure_future(run_client_command(command, client))
+
+def answer_status(client):
+    config = f"{arduino_config_hash:04X}" if arduino_config_hash is not None else "none"
+    protocol = "binary" if binary_mode else "text"
+
+    queued = command_queue.qsize() + outgoing_requests.qsize()
+    active = "; ".join(request.description for request in pending_requests.values())
+    open_operations = ",".join(str(key) for key, operation in operations.items() if not operation.future.done())
+
+    forward_to_client(client, f"STATUS connected={int(serial_port is not None)} ready={int(arduino_ready.is_set())} "
+                              f"protocol={protocol} config={config} queue={queued} ops={open_operations or '-'} "
+                              f"active={active or '-'}")
+    forward_to_client(client, "OK")
+
+# Última coleta de scrape_stats; o firmware não é consultado
+def answer_metrics(client):
+    try:
+        with open(METRICS_FILE, "r") as f:
+            forward_to_client(client, "METRICS " + json.dumps(json.load(f), separators=(",", ":")))
+        forward_to_client(client, "OK")
     except Exception as e:
-        logger.error(f"Error while writing to serial: {e}")
-        arduino_started = False
+        logger.warning(f"Failed to read metrics file: {e}")
+        forward_to_client(client, "ERROR")
 
-        try:
-            serial_port.close()
-        except Exception:
-            pass
-        serial_port = None
+# "wait_op [id]": espera uma operação aceita, ou todas as que ainda estão abertas, sem passar pela fila
+async def answer_wait_operation(argument: str, client):
+    try:
+        operation_ids = [int(argument)] if argument else \
+            [key for key, operation in operations.items() if not operation.future.done()]
+    except ValueError:
+        forward_to_client(client, "ERROR")
+        return
+
+    response = "OK"
+    for operation_id in operation_ids:
+        if await wait_operation(operation_id, client) != "OK":
+            response = "ERROR"
+
+    forward_to_client(client, response)
+
+# Respondidas pelo daemon fora da fila, inclusive durante um comando longo do firmware
+DAEMON_QUERIES = {
+    "status": answer_status,
+    "metrics": answer_metrics,
+}
+
+# Cada cliente recebe as respostas dos próprios comandos; uma conexão pode ter vários pedidos na fila
+async def handle_client(reader, writer):
+    logger.info("---------- Client connected ----------")
+    try:
+        while running:
+            data = await reader.readline()
+            if not data:
+                break
+
+            line = data.decode(errors="replace").strip()
+            if not line:
+                continue
+
+            logger.info(f"[Socket] <-- {line}")
+            request_id, command = parse_client_line(line)
+            client = ClientRequest(writer, request_id)
+
+            name, _, argument = command.partition(" ")
+
+            query = DAEMON_QUERIES.get(command.lower())
+            if query:
+                query(client)
+            elif name.lower() == "wait_op":
+                asyncio.ensure_future(answer_wait_operation(argument.strip(), client))
+            elif command:
+                command_queue.put_nowait((command, client))
+
+                if command_queue.qsize() > 1:
+                    logger.debug(f"[Queue] Size: {command_queue.qsize()}")
+    except Exception as e:
+        logger.error(f"Socket error: {e}")
     finally:
-        serial_reader_paused.clear()
+        writer.close()
+        logger.info("---------- Client disconnected ----------")
 
-def socket_server():
-    global output_conn
+async def main():
+    global arduino_ready
     global command_queue
-    global running
+    global outgoing_requests
+    global window_open
+
+    arduino_ready = asyncio.Event()
+    command_queue = asyncio.Queue()
+    outgoing_requests = asyncio.Queue()
+    window_open = asyncio.Event()
 
     if os.path.exists(SOCKET_PATH):
         os.remove(SOCKET_PATH)
 
-    server = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
     try:
-        server.bind(SOCKET_PATH)
+        server = await asyncio.start_unix_server(handle_client, path=SOCKET_PATH)
         os.chmod(SOCKET_PATH, 0o666)
-        server.listen()
         logger.info(f"Socket server listening on {SOCKET_PATH}")
     except Exception as e:
         logger.error(f"Failed to bind socket: {e}")
         sys.exit(1)
 
-    while running:
-        try:
-            conn, _ = server.accept()
-            output_conn = conn
-            logger.info("---------- Client connected ----------")
-
-            buffer = ""
-            while running:
-                chunk = conn.recv(1024).decode(errors="replace")
-                if not chunk:
-                    break
-
-                buffer += chunk
-                while "\n" in buffer:
-                    line, buffer = buffer.split("\n", 1)
-                    line = line.strip()
-                    if line:
-                        logger.info(f"[Socket] <-- {line}")
-                        command_queue.put(line)
-
-                        if command_queue.qsize() > 1:
-                            logger.debug(f"[Queue] Size: {command_queue.qsize()}")
-                
-                time.sleep(0.1)
-        except Exception as e:
-            logger.error(f"Socket error: {e}")
-        finally:
-            if output_conn:
-                output_conn.close()
-                output_conn = None
-                logger.info("---------- Client disconnected ----------")
+    # O Moonraker é consultado por HTTP bloqueante, fora do loop de eventos
+    threading.Thread(target=monitor_printer_status, daemon=True).start()
+
+    async with server:
+        await asyncio.gather(
+            scan_serial_ports(),
+            write_requests(),
+            process_command_queue(),
+            poll_firmware(),
+            monitor_arduino_status(),
+        )
 
 if __name__ == "__main__":
     try:
         logger.info("MMU Daemon starting...")
-        threading.Thread(target=scan_serial_ports, daemon=True).start()
-        threading.Thread(target=read_serial_background, daemon=True).start()
-        threading.Thread(target=process_command_queue, daemon=True).start()
-        threading.Thread(target=monitor_printer_status, daemon=True).start()
-        threading.Thread(target=monitor_arduino_status, daemon=True).start()
-        socket_server()
+        load_log_events()
+        asyncio.run(main())
     except KeyboardInterrupt:
         logger.info("Shutting down...")
     finally: